@@ -1,10 +1,25 @@
 #include "cache22.h" // Your custom server definitions (Client, Callback, CmdHandler)
 #include "tree.h"    // Your tree implementation definitions (Node, Leaf, root, find_node_linear, create_leaf, lookup_linear, print_tree_forward_leaves etc.)
+#include "uring.h"   // Optional io_uring I/O backend (uring_mainloop, uring_childloop)
+#include "shm.h"     // Shared-memory transport for same-host clients (Shm, shmloop)
+#include "watch.h"   // Change notifications shared between all connections (WATCH)
 
 // Global flags for server and child process continuation
 bool scontinuation; // Controls the main server loop in 'main'
 bool ccontinuation; // Controls the client handling loop in 'childloop'
 
+// Listening sockets of the server (TCP, plus the Unix domain socket unless disabled).
+int listeners[MaxListeners];
+int16 nlisteners;
+
+// Limits set on the command line (see main()).
+int32 maxconns = MaxConns;       // Connections served at once; more are turned away.
+int32 backlog = Backlog;         // listen() backlog of every listening socket.
+int32 idletimeout = IdleTimeout; // Seconds without progress before a connection is closed (0: never).
+int32 outlimit = OutLimit;       // Bytes of replies queued before they are sent out.
+
+static int32 nchildren;          // Child processes alive, one per connection (parent only).
+
 // --- Function Prototypes for Command Handlers ---
 // These functions will be called when their respective commands are received.
 // Each handler takes the client context, and two parsed string arguments (folder/path, args/key/value)
@@ -15,41 +30,160 @@ int32 handle_cd(Client *cli, int8 *path, int8 *args); // cd /some/path
 int32 handle_ls(Client *cli, int8 *path, int8 *args); // ls /some/path (list nodes/leaves)
 int32 handle_quit(Client *cli, int8 *arg1, int8 *arg2); // quit command to disconnect client
 int32 handle_print_tree(Client *cli, int8 *arg1, int8 *arg2); // Debug: print full tree to client
+int32 handle_shm(Client *cli, int8 *arg1, int8 *arg2); // switch to the shared-memory transport
+int32 handle_incr(Client *cli, int8 *path, int8 *key); // incr [path] key
+int32 handle_incrby(Client *cli, int8 *path, int8 *args); // incrby [path] key delta
+int32 handle_decr(Client *cli, int8 *path, int8 *key); // decr [path] key
+int32 handle_append(Client *cli, int8 *path, int8 *key_val_pair); // append [path] key=value
+int32 handle_compress(Client *cli, int8 *path, int8 *mode); // compress path on|off
+int32 handle_del(Client *cli, int8 *path, int8 *key); // del path [key]
+int32 handle_watch(Client *cli, int8 *path, int8 *args); // watch [path]
+int32 handle_unwatch(Client *cli, int8 *path, int8 *args); // unwatch path
+int32 handle_getv(Client *cli, int8 *path, int8 *key); // getv path key (value and version)
+int32 handle_cas(Client *cli, int8 *path, int8 *args); // cas path key version value
+int32 handle_multi(Client *cli, int8 *arg1, int8 *arg2); // start queueing a batch
+int32 handle_exec(Client *cli, int8 *arg1, int8 *arg2); // run the queued batch
+int32 handle_discard(Client *cli, int8 *arg1, int8 *arg2); // drop the queued batch
 
 // --- Command Handler Array ---
 // This array maps command strings (e.g., "GET") to their corresponding handler functions.
-// To add a new command, implement its handler function and add an entry here.
+// Each entry sits at its CmdSlot index (see cache22.h) so getcmd() can jump straight to it.
+// To add a new command, implement its handler, add a CmdSlot, an entry here and a case in cmdslot().
 CmdHandler handlers[] = {
-    {(int8 *)"hello", handle_hello},
-    {(int8 *)"GET", handle_get},
-    {(int8 *)"PUT", handle_put},
-    {(int8 *)"CD", handle_cd},
-    {(int8 *)"LS", handle_ls},
-    {(int8 *)"QUIT", handle_quit},
-    {(int8 *)"PRINT_TREE", handle_print_tree} // Debug command to print the entire tree
+    [CmdHello]     = {(int8 *)"hello", handle_hello},
+    [CmdGet]       = {(int8 *)"GET", handle_get},
+    [CmdPut]       = {(int8 *)"PUT", handle_put},
+    [CmdCd]        = {(int8 *)"CD", handle_cd},
+    [CmdLs]        = {(int8 *)"LS", handle_ls},
+    [CmdQuit]      = {(int8 *)"QUIT", handle_quit},
+    [CmdPrintTree] = {(int8 *)"PRINT_TREE", handle_print_tree}, // Debug command to print the entire tree
+    [CmdShm]       = {(int8 *)"SHM", handle_shm},
+    [CmdIncr]      = {(int8 *)"INCR", handle_incr},
+    [CmdIncrBy]    = {(int8 *)"INCRBY", handle_incrby},
+    [CmdDecr]      = {(int8 *)"DECR", handle_decr},
+    [CmdAppend]    = {(int8 *)"APPEND", handle_append},
+    [CmdCompress]  = {(int8 *)"COMPRESS", handle_compress},
+    [CmdDel]       = {(int8 *)"DEL", handle_del},
+    [CmdWatch]     = {(int8 *)"WATCH", handle_watch},
+    [CmdUnwatch]   = {(int8 *)"UNWATCH", handle_unwatch},
+    [CmdGetV]      = {(int8 *)"GETV", handle_getv},
+    [CmdCas]       = {(int8 *)"CAS", handle_cas},
+    [CmdMulti]     = {(int8 *)"MULTI", handle_multi},
+    [CmdExec]      = {(int8 *)"EXEC", handle_exec},
+    [CmdDiscard]   = {(int8 *)"DISCARD", handle_discard}
     // Add more commands here (e.g., "DELETE", "UPDATE")
 };
 
 // --- Helper Functions ---
 
-// Function to find a command handler by its name
-Callback getcmd(int8 *cmd) {
-    Callback cb = NULL; // Initialize function pointer to NULL (0)
-    int16 n;
-    // Calculate the number of elements in the handlers array dynamically.
-    // This is safer than hardcoding the size (e.g., '16').
-    int16 arrlen = sizeof(handlers) / sizeof(handlers[0]);
-
-    // Loop through the 'handlers' array
-    for (n = 0; n < arrlen; n++) {
-        // Compare the input command string with the command string in the current handler entry.
-        // 'strcmp' returns 0 if the strings are identical.
-        if (!strcmp((char *)cmd, (char *)handlers[n].cmd)) {
-            cb = handlers[n].handler; // Found a match, store the handler's function pointer.
-            break;                    // Exit the loop as the command has been found.
-        }
+// Perfect hash from a command name to its slot in 'handlers'.
+// The (length, first byte) pair is unique for every command we know, so a nested
+// switch resolves the slot in constant time without touching the other entries.
+static CmdSlot cmdslot(int8 *cmd, int16 len) {
+    switch (len) {
+        case 2:
+            switch (cmd[0]) {
+                case 'C': return CmdCd;
+                case 'L': return CmdLs;
+            }
+            break;
+        case 3:
+            switch (cmd[0]) {
+                case 'G': return CmdGet;
+                case 'P': return CmdPut;
+                case 'S': return CmdShm;
+                case 'D': return CmdDel;
+                case 'C': return CmdCas;
+            }
+            break;
+        case 4:
+            switch (cmd[0]) {
+                case 'Q': return CmdQuit;
+                case 'I': return CmdIncr;
+                case 'D': return CmdDecr;
+                case 'E': return CmdExec;
+                case 'G': return CmdGetV;
+            }
+            break;
+        case 5:
+            switch (cmd[0]) {
+                case 'h': return CmdHello;
+                case 'W': return CmdWatch;
+                case 'M': return CmdMulti;
+            }
+            break;
+        case 6:
+            switch (cmd[0]) {
+                case 'I': return CmdIncrBy;
+                case 'A': return CmdAppend;
+            }
+            break;
+        case 7:
+            switch (cmd[0]) {
+                case 'U': return CmdUnwatch;
+                case 'D': return CmdDiscard;
+            }
+            break;
+        case 8:
+            if (cmd[0] == 'C') return CmdCompress;
+            break;
+        case 10:
+            if (cmd[0] == 'P') return CmdPrintTree;
+            break;
     }
-    return cb; // Return the found handler function pointer (or NULL if no match was found).
+    return CmdNone;
+}
+
+// Function to find a command handler by its name.
+// 'len' is the length of 'cmd' as reported by tokenize(), so no strlen() is needed.
+Callback getcmd(int8 *cmd, int16 len) {
+    CmdSlot slot = cmdslot(cmd, len); // Candidate slot from the perfect hash.
+
+    if (slot == CmdNone)
+        return NULL; // No command has this shape.
+
+    // The hash only looks at two properties, so confirm the full name once.
+    // Comparing len+1 bytes also checks the terminating null of both strings.
+    if (memcmp(cmd, handlers[slot].cmd, len + 1))
+        return NULL;
+
+    return handlers[slot].handler; // Return the found handler function pointer.
+}
+
+// --- Zero-Copy Tokenizer ---
+// Splits a raw input line in place into its command, folder and args fields:
+//   <cmd> <folder> <args up to end of line>
+// Separators are overwritten with '\0' and the three pointers aim straight into 'buf',
+// so nothing is copied. Fields that are missing point at an empty string.
+// Returns the length of the command token (0 for a blank line).
+int16 tokenize(int8 *buf, int8 **cmd, int8 **folder, int8 **args) {
+    int8 *p = buf;
+    int16 cmdlen;
+
+#define IsSpace(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == '\v' || (c) == '\f')
+
+    // Command: first run of non-whitespace characters.
+    while (IsSpace(*p)) p++;
+    *cmd = p;
+    while (*p && !IsSpace(*p)) p++;
+    cmdlen = (int16)(p - *cmd);
+    if (*p) *p++ = '\0';
+
+    // Folder: second run of non-whitespace characters.
+    while (IsSpace(*p)) p++;
+    *folder = p;
+    while (*p && !IsSpace(*p)) p++;
+    if (*p) *p++ = '\0';
+
+    // Args: everything else on the line, stopping at a newline or carriage return.
+    while (IsSpace(*p)) p++;
+    *args = p;
+    while (*p && *p != '\n' && *p != '\r') p++;
+    *p = '\0';
+
+#undef IsSpace
+
+    return cmdlen;
 }
 
 // Custom error handling function: prints system error message and exits program.
@@ -60,77 +194,112 @@ void assert_perror(int system_call_return_value) {
     }
 }
 
-// Utility function to set a block of memory to all zeros.
-
-
+// --- Client Output Buffer ---
+// Handlers never write to the socket themselves. Everything they produce is queued
+// in 'cli->out' and leaves in one send per request (see cflush() and uring.c),
+// instead of one write() per dprintf() call.
+
+// Make room for at least 'n' more bytes in the client's output buffer.
+static bool creserve(Client *cli, int32 n) {
+    int32 cap;
+    int8 *p;
+
+    // Backpressure: past 'outlimit', hand what is queued to the client before queueing more.
+    // A long reply (or a burst of WATCH events) then waits for the client to read it instead
+    // of piling up in memory, and nothing else is read from this client in the meantime.
+    if (cli->outlen && cli->outlen + n > outlimit) {
+        if ((cli->shm ? shm_flush(cli) : cflush(cli)) < 0) {
+            ccontinuation = false; // The client is gone or stopped reading; end the session.
+            return false;
+        }
+    }
 
-// --- Command Handler Implementations ---
-// These functions implement the logic for each specific command.
+    if (cli->outlen + n <= cli->outcap)
+        return true;
+
+    // Grow geometrically so a long reply costs amortized O(1) per byte, but not past
+    // 'outlimit' unless a single piece needs more.
+    for (cap = cli->outcap ? cli->outcap : OutChunk; cap < cli->outlen + n; cap *= 2);
+    if (cap > outlimit && cli->outlen + n <= outlimit)
+        cap = outlimit;
+    p = (int8 *)realloc(cli->out, cap);
+    if (!p) {
+        perror("realloc failed for client output buffer");
+        return false;
+    }
+    cli->out = p;
+    cli->outcap = cap;
+    return true;
+}
 
-// Handler for the "hello" command.
-// Format: hello <any_folder_arg> <any_args_arg>
-int32 handle_hello(Client *cli, int8 *folder, int8 *args) {
-    // dprintf writes formatted output directly to the client's socket.
-    // It's a GNU extension, available because of '#define _GNU_SOURCE'.
-    dprintf(cli->s, "Server: Hello '%s'!\n", (char*)folder);
-    return 0; // Return 0 to indicate success.
+// Queue 'n' raw bytes for the client.
+void cwrite(Client *cli, int8 *data, int32 n) {
+    if (!n || !creserve(cli, n))
+        return;
+    memcpy(cli->out + cli->outlen, data, n);
+    cli->outlen += n;
 }
 
-// Handler for the "GET" command.
-// Format: GET <path> <key>
-int32 handle_get(Client *cli, int8 *path, int8 *key) {
-    // Basic validation of input arguments.
-    if (!path || !key || strlen((char*)path) == 0 || strlen((char*)key) == 0) {
-        dprintf(cli->s, "ERROR: GET command requires a path and a key. Usage: GET <path> <key>\n");
-        return -1; // Return -1 to indicate an error to the calling function.
-    }
+// Queue formatted output for the client (the buffered counterpart of dprintf).
+void cprintf(Client *cli, const char *fmt, ...) {
+    va_list ap;
+    int n;
 
-    // Call the tree's lookup function to find the value associated with the path and key.
-    int8 *value = lookup_linear((int8*)path, (int8*)key);
-    if (value) {
-        // If a value is found, send it back to the client.
-        dprintf(cli->s, "VALUE: ");
-        // 'write' is used for raw byte output, suitable for data that might not be null-terminated
-        // or contain embedded nulls, though here it's a string.
-        write(cli->s, (char*)value, (int)strlen((char*)value)); // write raw value bytes.
-        dprintf(cli->s, "\n");
-    } else {
-        // If the key is not found, inform the client.
-        dprintf(cli->s, "ERROR: Key '%s' not found in path '%s'.\n", (char*)key, (char*)path);
+    // First try to format straight into the free space left in the buffer.
+    va_start(ap, fmt);
+    n = vsnprintf((char *)cli->out + cli->outlen, cli->outcap - cli->outlen, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // It did not fit, or it would pass 'outlimit': let creserve() grow the buffer (+1 for
+    // vsnprintf's null) or send what is queued first, then format again.
+    if (cli->outlen + n >= cli->outcap || cli->outlen + n > outlimit) {
+        if (!creserve(cli, n + 1))
+            return;
+        va_start(ap, fmt);
+        vsnprintf((char *)cli->out + cli->outlen, cli->outcap - cli->outlen, fmt, ap);
+        va_end(ap);
     }
-    return 0; // Return 0 to indicate the command was processed (even if key not found).
+    cli->outlen += n;
 }
 
-// Handler for the "PUT" command.
-// Format: PUT <path> <key>=<value>
-// In cache22.c
-
-int32 handle_put(Client *cli, int8 *full_path, int8 *key_value_pair) {
-    // --- Initial Argument Validation ---
-    if (!full_path || strlen((char*)full_path) == 0 || !key_value_pair || strlen((char*)key_value_pair) == 0) {
-        dprintf(cli->s, "ERROR: PUT command requires a path and a key=value pair. Usage: PUT <path> <key>=<value>\n");
-        return -1;
+// Write everything queued for the client to its socket with plain write() calls.
+// Returns -1 if the connection failed.
+int cflush(Client *cli) {
+    int32 off;
+    ssize_t n;
+
+    for (off = 0; off < cli->outlen; off += n) {
+        n = write(cli->s, (char *)cli->out + off, cli->outlen - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            cli->outlen = 0;
+            return -1;
+        }
     }
+    cli->outlen = 0;
+    return 0;
+}
 
-    // --- Parse Key and Value ---
-    char *equal_sign = strchr((char*)key_value_pair, '=');
-    if (!equal_sign) {
-        dprintf(cli->s, "ERROR: PUT value must be in key=value format.\n");
-        return -1;
-    }
-    *equal_sign = '\0'; // Null-terminate the key part, effectively splitting the string.
-    int8 *key = key_value_pair; // 'key' now points to the beginning of the key_value_pair string.
-    int8 *value = (int8*)(equal_sign + 1); // 'value' points to the character after '='.
-    int16 value_len = (int16)strlen((char*)value);
+// --- Command Handler Implementations ---
+// These functions implement the logic for each specific command.
 
-    // Validate parsed key and value content.
-    if (strlen((char*)key) == 0 || value_len == 0) {
-        dprintf(cli->s, "ERROR: Key or Value cannot be empty in PUT command.\n");
-        return -1;
-    }
+// Handler for the "hello" command.
+// Format: hello <any_folder_arg> <any_args_arg>
+int32 handle_hello(Client *cli, int8 *folder, int8 *args) {
+    // cprintf queues formatted output on the client; it reaches the socket at the next flush.
+    cprintf(cli, "Server: Hello '%s'!\n", (char*)folder);
+    return 0; // Return 0 to indicate success.
+}
 
-    // --- Traverse/Create Nodes for the Path ---
-    // This section ensures all nodes in the 'full_path' exist or are created.
+// --- Path Creation ---
+// Ensures all nodes in 'full_path' exist, creating the missing ones, and returns the last one.
+// Reports failures to the client and returns NULL. Shared by PUT and the update commands.
+Node *make_path(Client *cli, int8 *full_path) {
     Node *current_parent_node = (Node*)&root; // Start traversal from the global root node.
     char temp_path_segment[256];             // Temporary buffer to hold each segment name (e.g., "users", "login").
     char current_full_path_so_far[256];      // Buffer to build the full path string for find_node_linear.
@@ -175,14 +344,11 @@ int32 handle_put(Client *cli, int8 *full_path, int8 *key_value_pair) {
 
         if (!found_node_for_segment) {
             // If the node for this segment does not exist in the tree's linear path, create it.
-            // 'create_node' links the new node as the 'west' child of 'current_parent_node'.
-            // WARNING: With the current tree structure (Node->west being the only child pointer),
-            // this will overwrite existing 'west' links if 'current_parent_node' already has one.
-            // This means it only effectively extends a single linear branch from the root.
+            // 'create_node' links the new node into the 'west' chain right after 'current_parent_node'.
             Node *new_node = create_node(current_parent_node, (int8*)current_full_path_so_far);
             if (!new_node) {
-                dprintf(cli->s, "ERROR: Failed to allocate memory for path node '%s'.\n", (char*)current_full_path_so_far);
-                return -1; // Critical failure, cannot create path.
+                cprintf(cli, "ERROR: Failed to allocate memory for path node '%s'.\n", (char*)current_full_path_so_far);
+                return NULL; // Critical failure, cannot create path.
             }
             current_parent_node = new_node; // Update 'current_parent_node' to point to the newly created node.
         } else {
@@ -201,72 +367,610 @@ int32 handle_put(Client *cli, int8 *full_path, int8 *key_value_pair) {
     // After the loop, 'current_parent_node' points to the final Node where the leaf should be stored.
     // If 'current_parent_node' is somehow NULL here, it indicates an internal logic error.
     if (!current_parent_node) {
-        dprintf(cli->s, "INTERNAL ERROR: Target path node is NULL after creation/lookup for '%s'.\n", (char*)full_path);
+        cprintf(cli, "INTERNAL ERROR: Target path node is NULL after creation/lookup for '%s'.\n", (char*)full_path);
+        return NULL;
+    }
+    return current_parent_node;
+
+}
+
+// --- Current Folder and Relative Paths ---
+
+// The client's current folder (root until the first CD).
+// The node cached by CD is used as is while no folder has been dropped since; after a
+// drop it may have been freed, so it is looked up again by path. NULL if it is gone.
+static Node *cwd(Client *cli) {
+    if (!*cli->cwdpath)
+        return (Node*)&root;
+    if (!cli->cwd || cli->cwddrops != drops) {
+        cli->cwd = find_node_linear(cli->cwdpath);
+        cli->cwddrops = drops;
+    }
+    return cli->cwd;
+}
+
+// Folds the "." and ".." segments, and repeated or trailing slashes, out of the absolute
+// 'path', in place, so no folder is ever named after them. ".." at the root stays there.
+static void normalize(int8 *path) {
+    int8 *r, *w, *seg;
+    size_t n;
+
+    for (r = w = path; *r;) {
+        while (*r == '/') r++;
+        if (!*r)
+            break;
+        for (seg = r; *r && *r != '/'; r++);
+        n = (size_t)(r - seg);
+        if (n == 1 && seg[0] == '.')
+            continue;
+        if (n == 2 && seg[0] == '.' && seg[1] == '.') {
+            while (w > path && *--w != '/'); // Back to the '/' starting the last segment.
+            continue;
+        }
+        *w++ = '/';
+        memmove(w, seg, n); // Never ahead of 'r', the text only moves left.
+        w += n;
+    }
+    if (w == path)
+        *w++ = '/';
+    *w = '\0';
+}
+
+// Resolves a path argument against the current folder:
+//   "" or "."   the current folder itself, straight from the cached handle
+//   "/a/b"      absolute, looked up as before
+//   "a/b"       relative to the current folder
+//   "..", "a/../b" and the like are folded first
+// 'abspath' (256 bytes) receives the absolute path, so callers can create the folder
+// with make_path() when this returns NULL. If the current folder itself is gone, or the
+// absolute path would not fit, the client is told, 'abspath' is left empty and NULL is
+// returned.
+static Node *resolve(Client *cli, int8 *path, int8 *abspath) {
+    Node *base;
+
+    if (*path == '/') {
+        if (snprintf((char*)abspath, 256, "%s", (char*)path) >= 256)
+            goto toolong;
+        normalize(abspath);
+        return find_node_linear(abspath);
+    }
+
+    base = cwd(cli);
+    if (!base) {
+        cprintf(cli, "ERROR: Current folder '%s' no longer exists. Use CD to pick another.\n", (char*)cli->cwdpath);
+        *abspath = '\0';
+        return NULL;
+    }
+    if (!*path || !strcmp((char*)path, ".")) {
+        snprintf((char*)abspath, 256, "%s", (char*)base->path);
+        return base;
+    }
+    if (snprintf((char*)abspath, 256, "%s%s%s", (char*)base->path, base->path[1] ? "/" : "", (char*)path) >= 256)
+        goto toolong;
+    normalize(abspath);
+    return find_node_linear(abspath);
+
+toolong:
+    // A truncated path would name another folder, one PUT would then create.
+    cprintf(cli, "ERROR: path too long.\n");
+    *abspath = '\0';
+    return NULL;
+}
+
+// Tells watching connections (WATCH) about the new state of leaf 'l' in folder 'n'.
+// Only one shared counter is read when nobody watches.
+static void notify_put(Node *n, Leaf *l) {
+    int8 num[NumSize];
+    int8 *value;
+    int16 size;
+
+    if (!watch_active())
+        return;
+    value = leaf_value(l, num, &size);
+    watch_publish(EvPut, n->path, l->key, value, size);
+}
+
+// Common part of GET and GETV; GETV also reports the leaf's version, for CAS.
+static int32 get(Client *cli, int8 *path, int8 *key, bool version) {
+    int8 abspath[256]; // Absolute form of 'path'.
+    Node *n;
+
+    // A single argument is the key, in the current folder.
+    if (strlen((char*)key) == 0) {
+        key = path;
+        path = (int8*)"";
+    }
+    // Basic validation of input arguments.
+    if (strlen((char*)key) == 0) {
+        cprintf(cli, "ERROR: %s command requires a key. Usage: %s [<path>] <key>\n", version ? "GETV" : "GET", version ? "GETV" : "GET");
+        return -1; // Return -1 to indicate an error to the calling function.
+    }
+
+    // Find the folder, then the leaf associated with the key in it.
+    n = resolve(cli, path, abspath);
+    if (!n && !*abspath)
+        return -1; // The current folder is gone or the path too long; resolve() said so.
+    Leaf *leaf = n ? find_leaf_in(n, key) : NULL;
+    if (leaf) {
+        // If a value is found, send it back to the client.
+        // Integer leaves are rendered into 'num'; string leaves are sent from their own buffer.
+        int8 num[NumSize];
+        int16 size;
+        int8 *value = leaf_value(leaf, num, &size);
+        if (version)
+            cprintf(cli, "VERSION: %u ", leaf->version);
+        cprintf(cli, "VALUE: ");
+        // 'cwrite' is used for raw byte output, suitable for data that might not be null-terminated
+        // or contain embedded nulls, though here it's a string.
+        cwrite(cli, value, (int32)size); // write raw value bytes.
+        cprintf(cli, "\n");
+    } else {
+        // If the key is not found, inform the client.
+        cprintf(cli, "ERROR: Key '%s' not found in path '%s'.\n", (char*)key, (char*)abspath);
+    }
+    return 0; // Return 0 to indicate the command was processed (even if key not found).
+}
+
+// Handler for the "GET" command.
+// Format: GET [<path>] <key>   (without a path, the key is read from the current folder)
+int32 handle_get(Client *cli, int8 *path, int8 *key) {
+    return get(cli, path, key, false);
+}
+
+// Handler for the "GETV" command.
+// Format: GETV [<path>] <key>   replies "VERSION: <n> VALUE: <value>"
+int32 handle_getv(Client *cli, int8 *path, int8 *key) {
+    return get(cli, path, key, true);
+}
+
+// Handler for the "PUT" command.
+// Format: PUT [<path>] <key>=<value>   (without a path, the key goes to the current folder)
+// In cache22.c
+
+int32 handle_put(Client *cli, int8 *full_path, int8 *key_value_pair) {
+    int8 abspath[256]; // Absolute form of 'full_path'.
+
+    // A single key=value argument goes to the current folder.
+    if (strlen((char*)key_value_pair) == 0 && strchr((char*)full_path, '=')) {
+        key_value_pair = full_path;
+        full_path = (int8*)"";
+    }
+    // --- Initial Argument Validation ---
+    if (strlen((char*)key_value_pair) == 0) {
+        cprintf(cli, "ERROR: PUT command requires a key=value pair. Usage: PUT [<path>] <key>=<value>\n");
         return -1;
     }
 
+    // --- Parse Key and Value ---
+    char *equal_sign = strchr((char*)key_value_pair, '=');
+    if (!equal_sign) {
+        cprintf(cli, "ERROR: PUT value must be in key=value format.\n");
+        return -1;
+    }
+    *equal_sign = '\0'; // Null-terminate the key part, effectively splitting the string.
+    int8 *key = key_value_pair; // 'key' now points to the beginning of the key_value_pair string.
+    int8 *value = (int8*)(equal_sign + 1); // 'value' points to the character after '='.
+    int16 value_len = (int16)strlen((char*)value);
+
+    // Validate parsed key and value content.
+    if (strlen((char*)key) == 0 || value_len == 0) {
+        cprintf(cli, "ERROR: Key or Value cannot be empty in PUT command.\n");
+        return -1;
+    }
+
+    // --- Find or Create the Folder ---
+    // An existing folder (the current one in particular) is found without walking the path.
+    Node *current_parent_node = resolve(cli, full_path, abspath);
+    if (!current_parent_node) {
+        if (!*abspath)
+            return -1; // The current folder is gone or the path too long; resolve() said so.
+        current_parent_node = make_path(cli, abspath);
+        if (!current_parent_node)
+            return -1;
+    }
+
     // --- Step 3: Store/Update Leaf under the found/created Node ---
     // Now, 'current_parent_node' is the actual Node where the leaf should reside.
-    // We pass 'current_parent_node->path' to find_leaf_linear to ensure
-    // we search for the leaf directly under this specific node.
-    Leaf *existing_leaf = find_leaf_linear((int8*)current_parent_node->path, (int8*)key);
+    // find_leaf_in searches for the leaf directly under this specific node.
+    Leaf *existing_leaf = find_leaf_in(current_parent_node, (int8*)key);
     if (existing_leaf) {
         // If the key already exists, update its value.
-        free(existing_leaf->value); // Free the old dynamically allocated value.
-        existing_leaf->value = (int8*)malloc(value_len + 1); // Allocate new memory (+1 for null terminator).
-        if (!existing_leaf->value) { perror("malloc failed for leaf value update"); return -1; }
-        zero(existing_leaf->value, value_len + 1); // Zero out the new memory block.
-        strncpy((char*)existing_leaf->value, (char*)value, value_len); // Copy the new value string.
-        existing_leaf->value[value_len] = '\0'; // Ensure null-termination for the copied value.
-        existing_leaf->size = value_len; // Update the size.
-        dprintf(cli->s, "OK: Key '%s' updated in path '%s'.\n", (char*)key, (char*)current_parent_node->path);
+        // set_leaf() copies into the existing buffer when it is big enough, and reallocates otherwise.
+        if (!set_leaf(existing_leaf, value, value_len)) { perror("set_leaf failed for leaf value update"); return -1; }
+        zip_leaf(existing_leaf, current_parent_node->dict); // Compress it if the folder asks for it.
+        notify_put(current_parent_node, existing_leaf);
+        cprintf(cli, "OK: Key '%s' updated in path '%s'.\n", (char*)key, (char*)current_parent_node->path);
     } else {
         // If the key does not exist, create a new leaf.
         // 'create_leaf' will handle allocating memory for the key and value.
-        create_leaf(current_parent_node, key, value, value_len);
-        dprintf(cli->s, "OK: Key '%s' created in path '%s'.\n", (char*)key, (char*)current_parent_node->path);
+        Leaf *new_leaf = create_leaf(current_parent_node, key, value, value_len);
+        if (!new_leaf) { perror("create_leaf failed for new leaf"); return -1; }
+        zip_leaf(new_leaf, current_parent_node->dict); // Compress it if the folder asks for it.
+        notify_put(current_parent_node, new_leaf);
+        cprintf(cli, "OK: Key '%s' created in path '%s'.\n", (char*)key, (char*)current_parent_node->path);
+    }
+    return 0;
+}
+
+// Splits 'p' after its first word: the word is null-terminated in place and the
+// start of the following word is returned (an empty string if there is none).
+static int8 *splitword(int8 *p) {
+    while (*p && *p != ' ' && *p != '\t') p++;
+    if (!*p)
+        return p;
+    *p++ = '\0';
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+// Finds the leaf 'key' under 'path', creating the path and an empty leaf when missing.
+// Its folder is stored at 'np'.
+static Leaf *make_leaf(Client *cli, int8 *path, int8 *key, Node **np) {
+    int8 abspath[256];
+    Node *n = resolve(cli, path, abspath);
+    Leaf *l;
+
+    if (!n && *abspath)
+        n = make_path(cli, abspath);
+    if (!(*np = n))
+        return NULL;
+    l = find_leaf_in(n, key);
+    return l ? l : create_leaf(n, key, (int8 *)"", 0);
+}
+
+// Common part of INCR, INCRBY and DECR.
+// The counter lives in the leaf as a native integer, so no string is parsed or
+// rebuilt per update; a missing key starts from 0.
+static int32 incr_by(Client *cli, int8 *path, int8 *key, long long delta) {
+    Node *n;
+    Leaf *l = make_leaf(cli, path, key, &n);
+    if (!l)
+        return -1;
+
+    if (!incr_leaf(l, delta)) {
+        if (errno == ERANGE)
+            cprintf(cli, "ERROR: Key '%s' in path '%s' would overflow.\n", (char*)key, (char*)n->path);
+        else
+            cprintf(cli, "ERROR: Value of key '%s' in path '%s' is not an integer.\n", (char*)key, (char*)n->path);
+        return -1;
+    }
+    notify_put(n, l);
+    cprintf(cli, "VALUE: %lld\n", l->num);
+    return 0;
+}
+
+// Handler for the "INCR" command.
+// Format: INCR [<path>] <key>   (without a path, the key is in the current folder)
+int32 handle_incr(Client *cli, int8 *path, int8 *key) {
+    splitword(key); // Ignore anything after the key.
+    if (!*key) {
+        key = path;
+        path = (int8*)"";
+    }
+    if (!*key) {
+        cprintf(cli, "ERROR: INCR command requires a key. Usage: INCR [<path>] <key>\n");
+        return -1;
+    }
+    return incr_by(cli, path, key, 1);
+}
+
+// Handler for the "DECR" command.
+// Format: DECR [<path>] <key>
+int32 handle_decr(Client *cli, int8 *path, int8 *key) {
+    splitword(key); // Ignore anything after the key.
+    if (!*key) {
+        key = path;
+        path = (int8*)"";
+    }
+    if (!*key) {
+        cprintf(cli, "ERROR: DECR command requires a key. Usage: DECR [<path>] <key>\n");
+        return -1;
+    }
+    return incr_by(cli, path, key, -1);
+}
+
+// Handler for the "INCRBY" command.
+// Format: INCRBY [<path>] <key> <delta>   (delta may be negative)
+int32 handle_incrby(Client *cli, int8 *path, int8 *args) {
+    int8 *key = args;
+    int8 *sdelta = splitword(key);
+    long long delta;
+    char *end;
+
+    // Two words are the key and the delta, in the current folder.
+    if (!*sdelta) {
+        sdelta = key;
+        key = path;
+        path = (int8*)"";
+    }
+    splitword(sdelta); // Ignore anything after the delta.
+    errno = 0;
+    delta = strtoll((char*)sdelta, &end, 10);
+    if (!*key || !*sdelta || *end || errno) {
+        cprintf(cli, "ERROR: INCRBY command requires a key and an integer. Usage: INCRBY [<path>] <key> <delta>\n");
+        return -1;
+    }
+    return incr_by(cli, path, key, delta);
+}
+
+// Handler for the "APPEND" command.
+// Format: APPEND [<path>] <key>=<value>
+// The leaf's buffer grows geometrically, so a series of appends costs amortized O(1) per byte
+// instead of copying the whole value every time. A missing key is created.
+int32 handle_append(Client *cli, int8 *path, int8 *key_value_pair) {
+    // A single key=value argument goes to the current folder, as with PUT.
+    if (!*key_value_pair && strchr((char*)path, '=')) {
+        key_value_pair = path;
+        path = (int8*)"";
+    }
+    char *equal_sign = strchr((char*)key_value_pair, '=');
+    if (!equal_sign || equal_sign == (char*)key_value_pair || !equal_sign[1]) {
+        cprintf(cli, "ERROR: APPEND command requires a key=value pair. Usage: APPEND [<path>] <key>=<value>\n");
+        return -1;
+    }
+    *equal_sign = '\0'; // Split key and value in place, as PUT does.
+    int8 *key = key_value_pair;
+    int8 *value = (int8*)(equal_sign + 1);
+
+    Node *n;
+    Leaf *l = make_leaf(cli, path, key, &n);
+    if (!l)
+        return -1;
+    if (!append_leaf(l, value, (int16)strlen((char*)value))) {
+        cprintf(cli, "ERROR: Value of key '%s' in path '%s' cannot grow past %d bytes.\n", (char*)key, (char*)n->path, MaxValue);
+        return -1;
+    }
+    zip_leaf(l, n->dict); // append_leaf() stores it raw; compress it again once it is big enough.
+    notify_put(n, l);
+    cprintf(cli, "OK: Key '%s' in path '%s' is now %u bytes.\n", (char*)key, (char*)n->path, (unsigned)l->size);
+    return 0;
+}
+
+// Splits the arguments of CAS, "<key> <version> <value>", in place.
+// The value is the rest of the line and may contain spaces.
+static bool cas_args(int8 *args, int8 **key, int32 *version, int8 **value) {
+    int8 *sversion;
+    unsigned long v;
+    char *end;
+
+    *key = args;
+    sversion = splitword(*key);
+    *value = splitword(sversion);
+    errno = 0;
+    v = strtoul((char*)sversion, &end, 10);
+    if (!**key || !*sversion || *end || errno || v > 0xffffffffUL || !**value)
+        return false;
+    *version = (int32)v;
+    return true;
+}
+
+// Version of 'key' under 'path' as CAS sees it: 0 for a missing key (or folder).
+// Returns -1 when the path cannot be resolved (resolve() told the client).
+static long long cas_version(Client *cli, int8 *path, int8 *key) {
+    int8 abspath[256];
+    Node *n = resolve(cli, path, abspath);
+    Leaf *l;
+
+    if (!n)
+        return *abspath ? 0 : -1;
+    l = find_leaf_in(n, key);
+    return l ? l->version : 0;
+}
+
+// Handler for the "CAS" command (compare and set).
+// Format: CAS <path> <key> <version> <value>
+// The path cannot be left out, since the value may hold spaces; '.' is the current folder.
+// Stores the value only if the leaf is still at 'version' (0: the key must not exist yet),
+// and replies with the new version. Every change of a leaf bumps its version, so a client
+// that read version N with GETV knows nobody wrote the key in between.
+int32 handle_cas(Client *cli, int8 *path, int8 *args) {
+    int8 abspath[256];
+    int8 *key, *value;
+    int32 version;
+    long long current;
+    Node *n;
+    Leaf *l;
+
+    if (!*path || !cas_args(args, &key, &version, &value)) {
+        cprintf(cli, "ERROR: CAS command requires a path ('.' for the current folder), a key, a version and a value. Usage: CAS <path> <key> <version> <value>\n");
+        return -1;
+    }
+
+    if ((current = cas_version(cli, path, key)) < 0)
+        return -1;
+    if (current != version) {
+        cprintf(cli, "ERROR: Key '%s' in path '%s' is at version %lld, not %u.\n", (char*)key, (char*)path, current, version);
+        return -1;
+    }
+
+    n = resolve(cli, path, abspath);
+    if (!n && !(*abspath && (n = make_path(cli, abspath))))
+        return -1;
+    if ((l = find_leaf_in(n, key))) {
+        if (!set_leaf(l, value, (int16)strlen((char*)value))) { perror("set_leaf failed for leaf value update"); return -1; }
+    } else {
+        if (!(l = create_leaf(n, key, value, (int16)strlen((char*)value)))) { perror("create_leaf failed for new leaf"); return -1; }
+    }
+    zip_leaf(l, n->dict);
+    notify_put(n, l);
+    cprintf(cli, "OK: Key '%s' in path '%s' is now at version %u.\n", (char*)key, (char*)n->path, l->version);
+    return 0;
+}
+
+// Handler for the "COMPRESS" command.
+// Format: COMPRESS <path> on|off
+// 'on' trains a dictionary on the values currently stored in the folder and compresses
+// every value of at least ZipMin bytes with it; later PUTs and APPENDs into the folder
+// are compressed too. Running it again retrains the dictionary. 'off' stores everything
+// raw again. The stored total reported counts the dictionary, which the folder pays for.
+int32 handle_compress(Client *cli, int8 *path, int8 *mode) {
+    int8 abspath[256];
+    Node *n;
+    Leaf *l;
+    int32 count, raw, stored;
+    bool on;
+
+    splitword(mode); // Ignore anything after the mode.
+    on = !strcmp((char*)mode, "on");
+    if (!*path || (!on && strcmp((char*)mode, "off"))) {
+        cprintf(cli, "ERROR: COMPRESS command requires a path and a mode. Usage: COMPRESS <path> on|off\n");
+        return -1;
+    }
+    n = resolve(cli, path, abspath);
+    if (!n) {
+        if (*abspath)
+            cprintf(cli, "ERROR: Path '%s' not found.\n", (char*)abspath);
+        return -1;
+    }
+
+    count = compress_node(n, on);
+    if (on && !n->dict) {
+        cprintf(cli, "ERROR: Out of memory training a dictionary for '%s'.\n", (char*)path);
+        return -1;
+    }
+    for (raw = stored = 0, l = n->east; l; l = l->east) {
+        raw += l->size;
+        stored += (l->tag & TagZip) ? l->zsize : l->size;
     }
+    if (on)
+        cprintf(cli, "OK: Compression on for '%s': %u-byte dictionary, %u leaves compressed, %u -> %u bytes (dictionary included).\n",
+            (char*)n->path, lz_dictbytes(n->dict), count, raw, stored + lz_dictbytes(n->dict));
+    else
+        cprintf(cli, "OK: Compression off for '%s'.\n", (char*)n->path);
+    return 0;
+}
+
+// Handler for the "DEL" command.
+// Format: DEL <path> <key>   removes one key
+//         DEL <path>         drops the folder, the folders below it and all their keys
+int32 handle_del(Client *cli, int8 *path, int8 *key) {
+    int8 abspath[256];
+    Node *n;
+    int32 count;
+
+    splitword(key); // Ignore anything after the key.
+    if (!*path) {
+        cprintf(cli, "ERROR: DEL command requires a path. Usage: DEL <path> [<key>]\n");
+        return -1;
+    }
+    n = resolve(cli, path, abspath);
+    if (!n) {
+        if (*abspath)
+            cprintf(cli, "ERROR: Path '%s' not found.\n", (char*)abspath);
+        return -1;
+    }
+
+    if (*key) {
+        if (!delete_leaf(n, key)) {
+            cprintf(cli, "ERROR: Key '%s' not found in path '%s'.\n", (char*)key, (char*)abspath);
+            return -1;
+        }
+        watch_publish(EvDel, n->path, key, NULL, 0);
+        cprintf(cli, "OK: Key '%s' deleted from path '%s'.\n", (char*)key, (char*)abspath);
+        return 0;
+    }
+
+    if (n == (Node*)&root) {
+        cprintf(cli, "ERROR: The root folder cannot be dropped.\n");
+        return -1;
+    }
+    // drop_node() bumps 'drops', which makes every cached CD handle look itself up again.
+    count = drop_node(n);
+    watch_publish(EvDrop, abspath, NULL, NULL, 0);
+    cprintf(cli, "OK: Dropped '%s' (%u folders).\n", (char*)abspath, count);
+    return 0;
+}
+
+// Handler for the "WATCH" command.
+// Format: WATCH <path>   (absolute or relative; the folder need not exist yet)
+//         WATCH          lists the watched subtrees
+// Changes under the subtree made by other connections are pushed as EVENT lines
+// (see watch.h), batched, between replies and while the connection is idle. They
+// describe the other sessions' trees; this connection's tree is left as it is.
+int32 handle_watch(Client *cli, int8 *path, int8 *args) {
+    int8 abspath[256];
+    Watcher *w;
+    int16 i;
+
+    if (!*path) {
+        w = cli->watch;
+        cprintf(cli, "Watching %u subtrees:\n", w ? (unsigned)w->n : 0);
+        for (i = 0; w && i < w->n; i++)
+            cprintf(cli, "  %s\n", (char*)w->paths[i]);
+        return 0;
+    }
+    if (!resolve(cli, path, abspath) && !*abspath)
+        return -1; // The current folder is gone or the path too long; resolve() said so.
+    if (watch_add(cli, abspath) < 0) {
+        if (errno == ENOSPC)
+            cprintf(cli, "ERROR: At most %d subtrees can be watched per connection.\n", WatchMax);
+        else
+            cprintf(cli, "ERROR: Change notifications unavailable.\n");
+        return -1;
+    }
+    cprintf(cli, "OK: Watching '%s'.\n", (char*)abspath);
+    return 0;
+}
+
+// Handler for the "UNWATCH" command.
+// Format: UNWATCH <path>
+int32 handle_unwatch(Client *cli, int8 *path, int8 *args) {
+    int8 abspath[256];
+
+    if (!*path) {
+        cprintf(cli, "ERROR: UNWATCH command requires a path. Usage: UNWATCH <path>\n");
+        return -1;
+    }
+    if (!resolve(cli, path, abspath) && !*abspath)
+        return -1;
+    if (!watch_remove(cli, abspath)) {
+        cprintf(cli, "ERROR: Path '%s' is not watched.\n", (char*)abspath);
+        return -1;
+    }
+    cprintf(cli, "OK: No longer watching '%s'.\n", (char*)abspath);
     return 0;
 }
 
 // Handler for the "CD" command (Change Directory/Node context).
-// Format: CD <path>
+// Format: CD <path>   (absolute, or relative to the current folder)
 int32 handle_cd(Client *cli, int8 *path, int8 *args) {
+    int8 abspath[256];
+
     // Check if a path argument is provided.
     if (!path || strlen((char*)path) == 0) {
-        dprintf(cli->s, "ERROR: CD command requires a path. Usage: CD <path>\n");
+        cprintf(cli, "ERROR: CD command requires a path. Usage: CD <path>\n");
         return -1;
     }
     // Find the Node specified by the path.
-    Node *target_node = find_node_linear((int8*)path);
+    Node *target_node = resolve(cli, path, abspath);
     if (target_node) {
-        // In a more complex server, the 'Client' struct would have a 'current_node' field
-        // to keep track of each client's "current directory" in the tree.
-        // For example: 'cli->current_node = target_node;'
-        dprintf(cli->s, "OK: Changed context to node '%s' (not persistent per client yet).\n", (char*)target_node->path);
-    } else {
-        dprintf(cli->s, "ERROR: Path '%s' not found.\n", (char*)path);
+        // Keep the resolved node in the client: GET/PUT/LS without a path, or with a
+        // relative one, start from it instead of resolving an absolute path every time.
+        cli->cwd = target_node;
+        cli->cwddrops = drops;
+        snprintf((char*)cli->cwdpath, sizeof(cli->cwdpath), "%s", (char*)target_node->path);
+        cprintf(cli, "OK: Changed context to node '%s'.\n", (char*)target_node->path);
+    } else if (*abspath) {
+        cprintf(cli, "ERROR: Path '%s' not found.\n", (char*)abspath);
     }
     return 0;
 }
 
 // Handler for the "LS" command (List contents of a Node/folder).
-// Format: LS [<path>] (lists children nodes and leaves under that path, default to root)
+// Format: LS [<path>] (lists children nodes and leaves under that path, default to the current folder)
 int32 handle_ls(Client *cli, int8 *path, int8 *args) {
+    int8 abspath[256];
     Node *target_node;
-    // Determine the target node: default to root if no path given, otherwise find the specified path.
-    if (!path || strlen((char*)path) == 0) {
-        target_node = (Node*)&root; // Assuming 'root' is globally accessible from tree.h/tree.c.
-    } else {
-        target_node = find_node_linear((int8*)path);
-    }
+    // Determine the target node: the current folder if no path given, otherwise the specified path.
+    target_node = resolve(cli, path, abspath);
 
     if (!target_node) {
-        dprintf(cli->s, "ERROR: Path '%s' not found.\n", (char*)path);
+        if (*abspath)
+            cprintf(cli, "ERROR: Path '%s' not found.\n", (char*)abspath);
         return -1;
     }
 
-    dprintf(cli->s, "Listing contents of '%s':\n", (char*)target_node->path);
+    cprintf(cli, "Listing contents of '%s':\n", (char*)target_node->path);
 
     // List child Nodes (if your tree supported horizontal node children)
     // Currently, your Node's 'west' is a linear chain, not typically for listing children of 'n'.
@@ -275,13 +979,16 @@ int32 handle_ls(Client *cli, int8 *path, int8 *args) {
 
     // List Leaves under this node
     Leaf *l = target_node->east; // Start from the first leaf connected via 'east'.
+    int8 num[NumSize];           // Rendering of integer leaves.
+    int16 size;
     if (!l) {
-        dprintf(cli->s, " (No leaves found)\n");
+        cprintf(cli, " (No leaves found)\n");
     } else {
         while(l != NULL) { // Iterate through all leaves in the 'east' chain.
-            dprintf(cli->s, "  L: %s -> '", (char*)l->key);
-            write(cli->s, (char*)l->value, (int)l->size); // Write raw value.
-            dprintf(cli->s, "'\n");
+            cprintf(cli, "  L: %s -> '", (char*)l->key);
+            int8 *value = leaf_value(l, num, &size);
+            cwrite(cli, value, (int32)size); // Write raw value.
+            cprintf(cli, "'\n");
             l = l->east; // Move to the next leaf.
         }
     }
@@ -291,42 +998,535 @@ int32 handle_ls(Client *cli, int8 *path, int8 *args) {
 // Handler for the "QUIT" command.
 // Format: QUIT
 int32 handle_quit(Client *cli, int8 *folder, int8 *args) {
-    dprintf(cli->s, "Server: Goodbye!\n");
+    cprintf(cli, "Server: Goodbye!\n");
     ccontinuation = false; // Set this flag to 'false' to break the 'childloop'
                            // which will lead to the child process exiting.
     return 0;
 }
 
+// Sink for print_tree_forward_leaves(): queue the output like any other reply.
+static void tree_out(void *ctx, int8 *data, int32 n) {
+    cwrite((Client *)ctx, data, n);
+}
+
 // Handler for the "PRINT_TREE" debug command.
 // Format: PRINT_TREE
 int32 handle_print_tree(Client *cli, int8 *folder, int8 *args) {
-    dprintf(cli->s, "Server: Printing entire tree to your client (debug output)...\n");
-    // Call the tree printing function, redirecting output to client's socket.
+    cprintf(cli, "Server: Printing entire tree to your client (debug output)...\n");
+    // Call the tree printing function, queueing its output on the client.
     // Assumes 'print_tree_forward_leaves' is the desired printer.
-    print_tree_forward_leaves(cli->s, &root);
-    dprintf(cli->s, "Server: Tree print complete.\n");
+    // Going through cwrite() keeps the order on every transport (socket, io_uring, SHM),
+    // and creserve() drains the queue whenever a big tree passes 'outlimit'.
+    print_tree_forward_leaves(tree_out, cli, &root);
+    cprintf(cli, "Server: Tree print complete.\n");
+    return 0;
+}
+
+// Handler for the "SHM" command (switch to the shared-memory transport).
+// Format: SHM
+// Replies with the name and size of a POSIX shared memory object laid out as a 'Shm'
+// (see shm.h). From then on the client writes commands into its request ring and
+// polls the response ring; the socket stays open and closing it ends the session.
+int32 handle_shm(Client *cli, int8 *folder, int8 *args) {
+    if (cli->shm) {
+        cprintf(cli, "ERROR: Shared memory transport already active ('%s').\n", cli->shmname);
+        return -1;
+    }
+    if (shm_attach(cli) < 0) {
+        perror("shm_attach");
+        cprintf(cli, "ERROR: Shared memory transport unavailable.\n");
+        return -1;
+    }
+    cprintf(cli, "OK: SHM %s %u\n", cli->shmname, (unsigned)sizeof(Shm));
+    return 0;
+}
+
+// --- Idle Connections ---
+
+// Seconds on the monotonic clock.
+time_t monotime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Seconds without progress after which 'cli' is idle. Waiting is what a watcher is for,
+// so it gets WatchIdle times as long, and each batch of events pushed to it counts as
+// progress too: only a watcher on a quiet subtree that sends nothing is closed.
+static time_t idle_limit(Client *cli) {
+    return (time_t)idletimeout * (cli->watch ? WatchIdle : 1);
+}
+
+// Milliseconds until 'cli' counts as idle: no command and no reply making progress for
+// idle_limit() seconds. 0 once it is, -1 if it never will (no timeout).
+// Capped at INT_MAX (about 24 days), as -i takes up to 2^31-1 seconds; the loops then
+// just wake up once more before the session is really idle.
+int idle_ms(Client *cli) {
+    time_t left;
+
+    if (!idletimeout)
+        return -1;
+    left = cli->last + idle_limit(cli) - monotime();
+    if (left <= 0)
+        return 0;
+    return (left < INT_MAX / 1000) ? (int)left * 1000 : INT_MAX;
+}
+
+// How long a client loop may wait for input: until the connection would become idle.
+// While watching the loops also wait on watch_fd(); only where there is none do they
+// wake up every WatchTick to look for changes. -1 means no limit.
+int wait_ms(Client *cli) {
+    int wait = idle_ms(cli);
+
+    if (cli->watch && watch_fd() < 0 && (wait < 0 || wait > WatchTick))
+        wait = WatchTick;
+    return wait;
+}
+
+// Ends an idle session; the goodbye is queued like any reply.
+void reap_idle(Client *cli) {
+    long long secs = (long long)idle_limit(cli);
+
+    printf("Server: Client %s:%d idle for %lld seconds, closing.\n", cli->ip, cli->port, secs);
+    cprintf(cli, "\nServer: Idle for %lld seconds, closing the connection.\n", secs);
+    ccontinuation = false;
+}
+
+// --- Command Dispatch ---
+// Parses one null-terminated line and runs its handler; the reply is queued on 'cli'.
+static void run(Client *cli, int8 *buf) {
+    int8 *cmd;          // Command token, points into 'buf'
+    int8 *folder;       // Folder/path token (argument 1), points into 'buf'
+    int8 *args;         // Arguments (argument 2), points into 'buf'
+    int16 cmdlen;       // Length of the command token
+    Callback handler_func; // Function pointer for the command handler
+
+    // --- Command Parsing ---
+    // Split 'buf' in place; cmd, folder and args all point into it afterwards.
+    cmdlen = tokenize(buf, &cmd, &folder, &args);
+
+    // Handle cases where parsing might not have extracted a command (e.g., empty line or just whitespace).
+    if (!cmdlen) {
+        cprintf(cli, "ERROR: Please enter a command.\n");
+        return;
+    }
+
+    // --- Command Execution ---
+    handler_func = getcmd(cmd, cmdlen); // Look up the command handler function using the parsed command string.
+
+    if (handler_func) {
+        // If a handler function is found (not NULL), execute it.
+        // Pass the client context and the parsed arguments.
+        handler_func(cli, folder, args);
+    } else {
+        // If no handler is found for the given command, inform the client.
+        cprintf(cli, "ERROR: Unknown command '%s'. Type QUIT to exit.\n", (char*)cmd);
+    }
+}
+
+// --- Transactions (MULTI/EXEC) ---
+// Between MULTI and EXEC, lines are only checked and queued. EXEC first walks the batch
+// without running it, following the versions its writes will give each key, and only
+// if every CAS will find the version it names runs the whole batch in one pass.
+// A connection is served by its own process with its own copy of the tree, which no other
+// connection reads or writes: nobody can observe the batch half applied, and only this
+// connection's commands can make its CASes stale. Watchers get the changes together in
+// their next push, as events about this session's tree.
+
+// Queues 'buf' on the open batch. Returns false for the lines that run right away
+// (EXEC, DISCARD, MULTI) and for empty ones.
+static bool queue_line(Client *cli, int8 *buf) {
+    Multi *m = cli->multi;
+    int8 line[256];
+    int8 *cmd, *folder, *args;
+    int16 cmdlen;
+    int32 n, cap;
+    Callback h;
+    int8 *p;
+
+    // Look at a copy: tokenize() splits in place and the line is queued as it came.
+    snprintf((char*)line, sizeof(line), "%s", (char*)buf);
+    cmdlen = tokenize(line, &cmd, &folder, &args);
+    if (!cmdlen)
+        return false;
+    h = getcmd(cmd, cmdlen);
+    if (h == handle_exec || h == handle_discard || h == handle_multi)
+        return false;
+    if (!h) {
+        cprintf(cli, "ERROR: Unknown command '%s'. EXEC will discard the batch.\n", (char*)cmd);
+        m->bad = true;
+        return true;
+    }
+
+    for (n = 0; buf[n] && buf[n] != '\n' && buf[n] != '\r'; n++);
+    if (m->n == MultiLines || m->len + n + 1 > MultiBytes) {
+        cprintf(cli, "ERROR: A batch holds at most %d commands and %d bytes. EXEC will discard the batch.\n",
+            MultiLines, MultiBytes);
+        m->bad = true;
+        return true;
+    }
+    if (m->len + n + 1 > m->cap) {
+        for (cap = m->cap ? m->cap : OutChunk; cap < m->len + n + 1; cap *= 2);
+        if (!(p = (int8 *)realloc(m->lines, cap))) {
+            perror("realloc failed for MULTI queue");
+            cprintf(cli, "ERROR: Out of memory. EXEC will discard the batch.\n");
+            m->bad = true;
+            return true;
+        }
+        m->lines = p;
+        m->cap = cap;
+    }
+    memcpy(m->lines + m->len, buf, n);
+    m->lines[m->len + n] = '\0';
+    m->len += n + 1;
+    m->n++;
+    cprintf(cli, "QUEUED\n");
+    return true;
+}
+
+static void free_multi(Client *cli) {
+    if (!cli->multi)
+        return;
+    free(cli->multi->lines);
+    free(cli->multi);
+    cli->multi = (Multi *)0;
+}
+
+// Handler for the "MULTI" command.
+// Format: MULTI   (the following lines are queued until EXEC or DISCARD)
+int32 handle_multi(Client *cli, int8 *folder, int8 *args) {
+    if (cli->multi) {
+        cprintf(cli, "ERROR: MULTI calls can not be nested.\n");
+        return -1;
+    }
+    cli->multi = (Multi *)malloc(sizeof(Multi));
+    if (!cli->multi) {
+        perror("malloc failed for MULTI queue");
+        cprintf(cli, "ERROR: Out of memory.\n");
+        return -1;
+    }
+    zero((int8 *)cli->multi, sizeof(Multi));
+    cprintf(cli, "OK: Queueing commands until EXEC.\n");
     return 0;
 }
 
+// Handler for the "DISCARD" command.
+// Format: DISCARD   (drops the queued batch)
+int32 handle_discard(Client *cli, int8 *folder, int8 *args) {
+    if (!cli->multi) {
+        cprintf(cli, "ERROR: DISCARD without MULTI.\n");
+        return -1;
+    }
+    cprintf(cli, "OK: Discarded %u queued commands.\n", (unsigned)cli->multi->n);
+    free_multi(cli);
+    return 0;
+}
+
+// Absolute form of 'path' at a point of the batch where the current folder is 'cwdpath',
+// as resolve() will compute it then; false if it will not fit.
+static bool batch_path(int8 *cwdpath, int8 *path, int8 *abspath) {
+    int n;
+
+    if (*path == '/')
+        n = snprintf((char*)abspath, 256, "%s", (char*)path);
+    else if (!*path || !strcmp((char*)path, "."))
+        n = snprintf((char*)abspath, 256, "%s", (char*)cwdpath);
+    else
+        n = snprintf((char*)abspath, 256, "%s%s%s", (char*)cwdpath, cwdpath[1] ? "/" : "", (char*)path);
+    if (n >= 256)
+        return false;
+    normalize(abspath);
+    return true;
+}
+
+// 'path' is 'dir' or a folder below it.
+static bool below_path(int8 *path, int8 *dir) {
+    size_t n = strlen((char*)dir);
+
+    if (!dir[1])
+        return true;
+    return !strncmp((char*)path, (char*)dir, n) && (!path[n] || path[n] == '/');
+}
+
+// Whether folder 'path' will exist at this point of the batch: it exists now and no DEL
+// of the batch dropped it so far, or a write of the batch created it (or one below it).
+static bool batch_exists(Expect *e, int16 ne, int8 *path) {
+    bool now;
+    int16 i;
+
+    for (i = 0; i < ne; i++)
+        if (e[i].made && below_path(e[i].path, path))
+            return true;
+    now = !path[1] || find_node_linear(path);
+    for (i = 0; i < ne && now; i++)
+        if (!*e[i].key && below_path(path, e[i].path))
+            now = false;
+    return now;
+}
+
+// What the batch expects of 'key' in 'path': the entry of the first command touching it,
+// else a new one starting from the tree (or 0 if the batch dropped its folder).
+static Expect *batch_key(Expect *e, int16 *ne, int8 *path, int8 *key) {
+    Node *n;
+    Leaf *l;
+    int16 i;
+
+    for (i = 0; i < *ne; i++)
+        if (*e[i].key && !strcmp((char*)e[i].key, (char*)key) && !strcmp((char*)e[i].path, (char*)path))
+            return &e[i];
+    snprintf((char*)e[i].path, sizeof(e[i].path), "%s", (char*)path);
+    snprintf((char*)e[i].key, sizeof(e[i].key), "%s", (char*)key);
+    e[i].made = false;
+    n = batch_exists(e, *ne, path) ? find_node_linear(path) : NULL;
+    l = n ? find_leaf_in(n, key) : NULL;
+    e[i].version = l ? l->version : 0;
+    (*ne)++;
+    return &e[i];
+}
+
+// Walks the batch without running it, resolving every path as it will be resolved then
+// (after the CDs before it) and following the version each write gives its key: PUT and
+// CAS bump it, DEL clears it, INCR, DECR, INCRBY and APPEND make it unknown since they may
+// fail on the value they find. Returns false, having told the client, when a CAS would
+// not find the version it names, so the batch must not run at all.
+static bool check_batch(Client *cli, Multi *m) {
+    int8 line[256], cwdpath[256], abspath[256];
+    int8 *cmd, *path, *rest, *key, *value, *p;
+    char *eq, *end;
+    Expect *e, *x;
+    Callback h;
+    int32 version;
+    int16 cmdlen, i, j, ne;
+    bool ok;
+
+    // Every line adds at most one entry.
+    if (!(e = (Expect *)malloc((m->n ? m->n : 1) * sizeof(Expect)))) {
+        perror("malloc failed for EXEC check");
+        cprintf(cli, "ERROR: Out of memory. Nothing was applied.\n");
+        return false;
+    }
+    snprintf((char*)cwdpath, sizeof(cwdpath), "%s", *cli->cwdpath ? (char*)cli->cwdpath : "/");
+
+    for (ok = true, ne = i = 0, p = m->lines; ok && i < m->n; i++, p += strlen((char*)p) + 1) {
+        snprintf((char*)line, sizeof(line), "%s", (char*)p);
+        cmdlen = tokenize(line, &cmd, &path, &rest);
+        h = getcmd(cmd, cmdlen);
+        key = (int8*)"";
+
+        // Pick the folder and key each command will use, as its handler parses them.
+        if (h == handle_put || h == handle_append) {
+            if (!*rest && strchr((char*)path, '=')) {
+                rest = path;
+                path = (int8*)"";
+            }
+            if (!(eq = strchr((char*)rest, '=')) || eq == (char*)rest || !eq[1])
+                continue; // A usage error, which changes nothing.
+            *eq = '\0';
+            key = rest;
+        } else if (h == handle_incr || h == handle_decr) {
+            splitword(rest);
+            key = *rest ? rest : path;
+            path = *rest ? path : (int8*)"";
+            if (!*key)
+                continue;
+        } else if (h == handle_incrby) {
+            key = rest;
+            value = splitword(key);
+            if (!*value) {
+                value = key;
+                key = path;
+                path = (int8*)"";
+            }
+            splitword(value);
+            errno = 0;
+            strtoll((char*)value, &end, 10);
+            if (!*key || !*value || *end || errno)
+                continue;
+        } else if (h == handle_cas) {
+            if (!*path || !cas_args(rest, &key, &version, &value))
+                continue; // It will report its own usage error.
+        } else if (h == handle_del) {
+            if (!*path)
+                continue;
+            splitword(rest);
+            key = rest;
+        } else if (h != handle_cd) {
+            continue; // Reads leave every version as it is.
+        }
+
+        // Resolve the path against the current folder of this point of the batch.
+        if (!batch_path(cwdpath, path, abspath) || (*path != '/' && !batch_exists(e, ne, cwdpath))) {
+            if (h == handle_cas) {
+                cprintf(cli, "ERROR: Path '%s' of CAS will not resolve when the batch runs. Nothing was applied.\n", (char*)path);
+                ok = false;
+            }
+            continue; // The command will fail on the path and change nothing.
+        }
+
+        if (h == handle_cd) {
+            if (*path && batch_exists(e, ne, abspath))
+                memcpy(cwdpath, abspath, sizeof(cwdpath));
+        } else if (h == handle_del && !*key) {
+            // The folder goes with everything below it, kept as an entry without a key.
+            if (!abspath[1] || !batch_exists(e, ne, abspath))
+                continue;
+            for (j = 0; j < ne; j++)
+                if (below_path(e[j].path, abspath)) {
+                    e[j].version = 0;
+                    e[j].made = false;
+                }
+            snprintf((char*)e[ne].path, sizeof(e[ne].path), "%s", (char*)abspath);
+            *e[ne].key = '\0';
+            e[ne].made = false;
+            ne++;
+        } else if (h == handle_del) {
+            batch_key(e, &ne, abspath, key)->version = 0;
+        } else {
+            x = batch_key(e, &ne, abspath, key);
+            if (h == handle_cas && x->version < 0) {
+                cprintf(cli, "ERROR: Key '%s' in path '%s' is changed by an INCR, DECR, INCRBY or APPEND earlier in the batch, "
+                    "so CAS cannot check its version. Nothing was applied.\n", (char*)key, (char*)abspath);
+                ok = false;
+            } else if (h == handle_cas && x->version != version) {
+                cprintf(cli, "ERROR: Key '%s' in path '%s' is at version %lld, not %u. Nothing was applied.\n",
+                    (char*)key, (char*)abspath, x->version, version);
+                ok = false;
+            } else if ((h == handle_put || h == handle_cas) && x->version >= 0) {
+                x->version++;
+            } else {
+                x->version = -1;
+            }
+            x->made = true;
+        }
+    }
+    free(e);
+    return ok;
+}
+
+// Handler for the "EXEC" command.
+// Format: EXEC   (runs the queued batch, all of it or, if a CAS version is stale, none of it)
+// The replies of the batch follow one another, then a line with the count.
+int32 handle_exec(Client *cli, int8 *folder, int8 *args) {
+    Multi *m = cli->multi;
+    int8 line[256];
+    int8 *p;
+    int16 i;
+
+    if (!m) {
+        cprintf(cli, "ERROR: EXEC without MULTI.\n");
+        return -1;
+    }
+    cli->multi = (Multi *)0; // The batch runs as ordinary commands.
+    if (m->bad) {
+        cprintf(cli, "ERROR: Batch discarded, a queued command was rejected.\n");
+        goto done;
+    }
+
+    // Every CAS must hold at its point of the batch before anything runs. They check
+    // their versions again as they run, which then always succeeds.
+    if (!check_batch(cli, m))
+        goto done;
+
+    for (i = 0, p = m->lines; i < m->n; i++, p += strlen((char*)p) + 1) {
+        snprintf((char*)line, sizeof(line), "%s", (char*)p);
+        run(cli, line);
+    }
+    cprintf(cli, "OK: EXEC ran %u commands.\n", (unsigned)m->n);
+
+done:
+    cli->multi = m;
+    free_multi(cli);
+    return 0;
+}
+
+// Runs one raw input line (already null-terminated) for the client.
+// The reply, followed by a fresh prompt, is queued in the client's output buffer.
+// Inside MULTI the line is queued for EXEC instead.
+// Shared by childloop() and the io_uring loop in uring.c.
+void dispatch(Client *cli, int8 *buf) {
+    cli->last = monotime();
+    if (!cli->multi || !queue_line(cli, buf))
+        run(cli, buf);
+
+    // Queue a prompt for the client's next command, after processing the current one.
+    cprintf(cli, "> ");
+}
+
+// Takes 'n' bytes received from the client's socket and runs every complete line in them,
+// along with the start of a line kept from earlier reads: one read may carry several
+// pipelined commands, or part of one. A line longer than 'in' is cut there, the rest of
+// it dropped, as shm_getline() does. Stops once a command ended the session (QUIT).
+void receive(Client *cli, int8 *data, int32 n) {
+    int32 i;
+    int8 c;
+
+    for (i = 0; i < n && ccontinuation; i++) {
+        c = data[i];
+        if (c != '\n') {
+            if (!cli->inskip && cli->inlen < sizeof(cli->in) - 1)
+                cli->in[cli->inlen++] = c;
+            else if (!cli->inskip) {
+                cli->in[cli->inlen] = '\0';
+                dispatch(cli, cli->in);
+                cli->inlen = 0;
+                cli->inskip = true;
+            }
+            continue;
+        }
+        if (!cli->inskip) {
+            cli->in[cli->inlen] = '\0';
+            dispatch(cli, cli->in);
+        }
+        cli->inlen = 0;
+        cli->inskip = false;
+    }
+}
 
 // --- Main Client Handling Loop for a Child Process ---
 // This function runs in each forked child process to handle a single client's commands.
+// The io_uring loop is tried first; plain read()/write() is the fallback when the
+// kernel (or the build) does not support it.
 void childloop(Client *cli) {
-    int8 buf[256];      // Buffer for raw client input (max 255 chars + null)
-    int8 cmd[256];      // Parsed command string
-    int8 folder[256];   // Parsed folder/path string (argument 1)
-    int8 args[256];     // Parsed arguments string (argument 2)
+    int8 buf[256];      // Buffer for raw client input, any number of (partial) lines
     ssize_t bytes_read; // Number of bytes read from socket (can be 0 or -1)
-    Callback handler_func; // Function pointer for the command handler
+    int wait;           // Milliseconds poll() may wait for input, -1 for no limit
+    int ready;          // Result of poll()
+    struct pollfd pfd[2];
+
+    if (!uring_childloop(cli))
+        return; // The io_uring loop served the whole connection.
 
     // Loop continuously to handle multiple commands from the same client.
     ccontinuation = true; // Ensure this flag is true to start the loop.
     while (ccontinuation) {
-        zero(buf, sizeof(buf)); // Clear the input buffer before each read for safety.
+        // Send the replies (and prompt) queued by the previous command,
+        // along with the changes under watched subtrees since the last pass.
+        watch_push(cli);
+        if (cflush(cli) < 0) {
+            perror("Error writing to client socket");
+            break;
+        }
+
+        // Wait for input no longer than until the connection becomes idle. While
+        // watching, watch_fd() wakes us as well, to push the changes made by others.
+        wait = wait_ms(cli);
+        if (wait >= 0 || cli->watch) {
+            pfd[0] = (struct pollfd){cli->s, POLLIN, 0};
+            pfd[1] = (struct pollfd){watch_fd(), POLLIN, 0};
+            ready = poll(pfd, (cli->watch && pfd[1].fd >= 0) ? 2 : 1, wait);
+            if (ready > 0 && pfd[1].revents)
+                watch_drain();
+            if (ready <= 0 || !pfd[0].revents) {
+                if (!idle_ms(cli))
+                    reap_idle(cli);
+                continue;
+            }
+        }
 
         // --- Read Data from Client Socket ---
-        // Reads up to (sizeof(buf) - 1) bytes to leave space for a null terminator.
-        bytes_read = read(cli->s, (char *)buf, sizeof(buf) - 1);
+        // Reads whatever arrived, up to sizeof(buf) bytes; receive() finds the lines in it.
+        bytes_read = read(cli->s, (char *)buf, sizeof(buf));
 
         if (bytes_read <= 0) { // Check if client disconnected (0 bytes) or an error occurred (-1).
             if (bytes_read == 0) {
@@ -344,43 +1544,17 @@ void childloop(Client *cli) {
             break; // Exit the loop.
         }
 
-        buf[bytes_read] = '\0'; // CRITICAL: Null-terminate the received data. This turns 'buf' into a valid C string.
-
-        // --- Command Parsing using sscanf ---
-        // sscanf parses formatted input from a string.
-        // %255s: reads up to 255 non-whitespace characters into cmd, folder, args.
-        // %255[^\n\r]s: reads up to 255 characters until a newline or carriage return is encountered (for the 'args' part).
-        // It returns the number of items successfully assigned.
-        int num_parsed = sscanf((char*)buf, "%255s %255s %255[^\n\r]s", (char*)cmd, (char*)folder, (char*)args);
-
-        // Ensure all parsed buffers are null-terminated, even if sscanf didn't fill them.
-        // This is necessary if sscanf didn't assign to a variable.
-        if (num_parsed < 1) zero(cmd, sizeof(cmd));
-        if (num_parsed < 2) zero(folder, sizeof(folder));
-        if (num_parsed < 3) zero(args, sizeof(args));
-
+        receive(cli, buf, (int32)bytes_read); // Run the complete lines; the replies are queued on 'cli'.
 
-        // Handle cases where parsing might not have extracted a command (e.g., empty line or just whitespace).
-        if (strlen((char*)cmd) == 0) {
-            dprintf(cli->s, "ERROR: Please enter a command.\n> "); // Prompt again.
-            continue; // Skip to next iteration of while loop.
+        // After a successful SHM the rest of the session runs over shared memory.
+        if (cli->shm) {
+            cflush(cli);
+            shmloop(cli);
+            return;
         }
-
-        // --- Command Execution ---
-        handler_func = getcmd(cmd); // Look up the command handler function using the parsed command string.
-
-        if (handler_func) {
-            // If a handler function is found (not NULL), execute it.
-            // Pass the client context and the parsed arguments.
-            handler_func(cli, folder, args);
-        } else {
-            // If no handler is found for the given command, inform the client.
-            dprintf(cli->s, "ERROR: Unknown command '%s'. Type QUIT to exit.\n", (char*)cmd);
-        }
-        
-        // Send a prompt to the client for their next command, after processing the current one.
-        dprintf(cli->s, "> ");
     } // End of while(ccontinuation) loop
+
+    cflush(cli); // Deliver anything still queued (e.g., the QUIT goodbye).
 }
 
 // --- Server Initialization Function ---
@@ -404,44 +1578,91 @@ int initserver(int16 port) {
     assert_perror(bind_result); // Check for errors during binding.
 
     // Put the socket into listening mode.
-    // '20' is the backlog queue size, defining how many pending client connections
+    // 'backlog' ('-b') is the queue size, defining how many pending client connections
     // can wait to be accepted before the server starts rejecting new connections.
-    int listen_result = listen(s, 20);
+    int listen_result = listen(s, (int)backlog);
     assert_perror(listen_result); // Check for errors during listening setup.
 
     printf("Server listening on %s:%d\n", HOST, port); // Inform the server operator.
     return s; // Return the file descriptor of the listening socket.
 }
 
+// --- Unix Domain Socket Initialization ---
+// Sets up a second listening socket at the filesystem 'path' for clients on the same host.
+// It skips the TCP/IP stack entirely, which makes local round trips noticeably cheaper.
+int initunix(char *path) {
+    struct sockaddr_un sock; // Structure to hold the socket's filesystem address.
+    int s;                   // File descriptor for the listening socket.
 
-// --- Main Server Loop for Accepting Connections ---
-// This function runs in the parent process, continuously accepting new client connections.
-void mainloop(int s) {
-    struct sockaddr_in cli;       // Structure to hold the connecting client's address.
-    socklen_t len = sizeof(cli);  // Correctly initialized length for accept().
-    int s2;                       // File descriptor for the NEW socket specific to the accepted client.
+    if (strlen(path) >= sizeof(sock.sun_path)) {
+        fprintf(stderr, "Unix socket path '%s' is too long.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    zero((int8 *)&sock, sizeof(sock));
+    sock.sun_family = AF_UNIX;
+    strncpy(sock.sun_path, path, sizeof(sock.sun_path) - 1);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_perror(s);
+
+    // Remove a socket file left behind by a previous run, otherwise bind() fails with EADDRINUSE.
+    // Only a socket is ever removed, and only when no server answers on it any more.
+    struct stat st;
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "'%s' exists and is not a socket; not replacing it.\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (!connect(s, (struct sockaddr *)&sock, sizeof(sock))) {
+            fprintf(stderr, "Another server is listening on '%s'.\n", path);
+            exit(EXIT_FAILURE);
+        }
+        close(s); // A failed connect() leaves the socket unusable for bind().
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        assert_perror(s);
+        unlink(path);
+    }
+    int bind_result = bind(s, (struct sockaddr *)&sock, sizeof(sock));
+    assert_perror(bind_result);
+
+    int listen_result = listen(s, (int)backlog);
+    assert_perror(listen_result);
+
+    printf("Server listening on %s\n", path);
+    return s;
+}
+
+
+// --- Client Process Creation ---
+// Forks a child process to serve the freshly accepted socket 's2'.
+// 'cli' is the peer address from accept(): IPv4 for TCP clients, AF_UNIX for local ones.
+void spawn(int s2, struct sockaddr *cli) {
     char *ip;                     // Pointer to the client's IP address string.
     int16 port;                   // Client's port number.
     Client *client;               // Dynamically allocated structure to store client-specific data.
     pid_t pid;                    // Variable to store the process ID returned by fork().
-
-    // Accept an incoming connection.
-    // This call blocks the parent process until a client attempts to connect to the listening socket 's'.
-    s2 = accept(s, (struct sockaddr *)&cli, &len);
-    if (s2 < 0) {
-        // Handle accept errors. EINTR means the call was interrupted by a signal (e.g., Ctrl+C).
-        // For EINTR, we can often just retry accepting. For other errors, we might consider exiting.
-        if (errno == EINTR) {
-            return; // Return to the main loop to try accept again.
-        }
-        assert_perror(s2); // For other critical errors, this will print and exit.
-    }
+    int16 n;
 
     // Extract and print client details for the server's console.
-    port = (int16)ntohs(cli.sin_port); // Convert port from network to host byte order.
-    ip = inet_ntoa(cli.sin_addr);       // Convert IP address to human-readable string.
+    if (cli->sa_family == AF_INET) {
+        port = (int16)ntohs(((struct sockaddr_in *)cli)->sin_port); // Convert port from network to host byte order.
+        ip = inet_ntoa(((struct sockaddr_in *)cli)->sin_addr);       // Convert IP address to human-readable string.
+    } else {
+        port = 0;      // Unix domain peers have no address worth printing.
+        ip = "unix";
+    }
     printf("Server: Connection from %s:%d (socket %d)\n", ip, port, s2);
 
+    // Admission control: with 'maxconns' connections open, turn this one away without forking.
+    // The SIGCHLD handler counts the finished ones back down.
+    if (__atomic_load_n(&nchildren, __ATOMIC_RELAXED) >= maxconns) {
+        static const char busy[] = "ERROR: Too many connections, try again later.\n";
+        printf("Server: Refusing %s:%d, %u connections open.\n", ip, port, maxconns);
+        send(s2, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(s2);
+        return;
+    }
+
     // Allocate and populate the Client struct.
     client = (Client *)malloc(sizeof(struct s_client));
     if (!client) { // Robust check for malloc failure.
@@ -456,7 +1677,12 @@ void mainloop(int s) {
     strncpy(client->ip, ip, sizeof(client->ip) - 1);
     client->ip[sizeof(client->ip) - 1] = '\0'; // Guarantee null-termination.
 
+    // Flush the console before forking so buffered log lines are not printed twice.
+    fflush(stdout);
+
     // Fork a new process to handle the client.
+    // Count it first: a child that exits right away must not be reaped before it was counted.
+    __atomic_fetch_add(&nchildren, 1, __ATOMIC_RELAXED);
     pid = fork();
 
     if (pid > 0) { // This block is executed by the PARENT PROCESS.
@@ -472,20 +1698,33 @@ void mainloop(int s) {
         return;
     } else if (pid == 0) { // This block is executed by the CHILD PROCESS.
         // Child's responsibilities:
-        // 1. Close its copy of the main listening socket ('s').
+        // 1. Close its copies of the listening sockets and of the parent's io_uring.
         //    The child's purpose is to communicate with its specific client ('s2'),
-        //    not to accept new connections. Closing 's' prevents resource leaks in the child.
-        close(s);
+        //    not to accept new connections. Closing them prevents resource leaks in the child.
+        for (n = 0; n < nlisteners; n++)
+            close(listeners[n]);
+        uring_detach();
+
+        // Blocking writes to a client that stopped reading give up after the idle timeout.
+        client->last = monotime();
+        if (idletimeout) {
+            struct timeval tv = {(time_t)idletimeout, 0};
+            setsockopt(client->s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
 
-        // Send an initial welcome message and prompt to the client.
-        dprintf(client->s, "100 Connected to Cache22 server.\n");
-        dprintf(client->s, "Type 'HELP' for commands, 'QUIT' to disconnect.\n> ");
+        // Queue an initial welcome message and prompt for the client.
+        cprintf(client, "100 Connected to Cache22 server.\n");
+        cprintf(client, "Type 'HELP' for commands, 'QUIT' to disconnect.\n> ");
 
         // Enter the client handling loop.
         childloop(client); // This function now contains the while(ccontinuation) loop for persistent interaction.
 
         // Child process cleanup after 'childloop' exits (e.g., client sends 'QUIT' or disconnects).
         close(client->s); // Close the client-specific socket.
+        shm_detach(client); // Unmap and remove its shared-memory rings, if any.
+        watch_detach(client); // Stop counting as a watcher.
+        free_multi(client);   // Drop a batch left open by MULTI.
+        free(client->out); // Free the client's output buffer.
         free(client);     // Free the dynamically allocated 'Client' struct memory.
         printf("Server: Child process for %s:%d exited.\n", ip, port); // Log child exit.
         exit(0); // CRITICAL: The child process MUST call 'exit(0)' here.
@@ -494,48 +1733,167 @@ void mainloop(int s) {
                  // leading to chaotic and incorrect server behavior.
     } else { // pid == -1 (fork failed).
         // Handle error if 'fork()' itself failed (e.g., system out of process slots).
-        // 'assert_perror' will print the error and exit the parent process.
-        assert_perror(pid);
+        // Turn this client away but keep serving the others.
+        perror("fork");
+        __atomic_fetch_sub(&nchildren, 1, __ATOMIC_RELAXED);
+        close(s2);
+        free(client);
+    }
+}
+
+// SIGCHLD handler of the parent: reaps finished children, so they neither linger
+// as zombies nor keep counting against 'maxconns'. A child killed by a signal had no
+// chance to remove its shared-memory object, so that is done here.
+static void onchild(int sig) {
+    int saved = errno; // waitpid() may change errno under the interrupted code.
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        __atomic_fetch_sub(&nchildren, 1, __ATOMIC_RELAXED);
+        if (WIFSIGNALED(status))
+            shm_reap(pid);
+    }
+    errno = saved;
+}
+
+// --- Main Server Loop for Accepting Connections ---
+// This function runs in the parent process, continuously accepting new client connections.
+// It is the fallback used when uring_mainloop() is unavailable.
+void mainloop(void) {
+    struct pollfd pfd[MaxListeners]; // One entry per listening socket.
+    struct sockaddr_storage cli;  // Structure to hold the connecting client's address (IPv4 or Unix).
+    socklen_t len;                // Length of 'cli', reset before every accept().
+    int s2;                       // File descriptor for the NEW socket specific to the accepted client.
+    int16 n;
+
+    // Block until at least one listening socket has a connection waiting.
+    for (n = 0; n < nlisteners; n++) {
+        pfd[n].fd = listeners[n];
+        pfd[n].events = POLLIN;
+    }
+    if (poll(pfd, nlisteners, -1) < 0) {
+        if (errno == EINTR) {
+            return; // Return to the main loop to try again.
+        }
+        assert_perror(-1);
+    }
+
+    for (n = 0; n < nlisteners; n++) {
+        if (!(pfd[n].revents & POLLIN))
+            continue;
+
+        // Accept the incoming connection; poll() said it is ready, so this does not block for long.
+        len = sizeof(cli);
+        s2 = accept(listeners[n], (struct sockaddr *)&cli, &len);
+        if (s2 < 0) {
+            // Handle accept errors. EINTR means the call was interrupted by a signal (e.g., Ctrl+C).
+            // For EINTR, we can often just retry accepting. For other errors, we might consider exiting.
+            if (errno == EINTR) {
+                return; // Return to the main loop to try accept again.
+            }
+            assert_perror(s2); // For other critical errors, this will print and exit.
+        }
+
+        spawn(s2, (struct sockaddr *)&cli); // Hand the connection to a new child process.
     }
-    // This 'return;' is unreachable as all execution paths (parent, child, fork failure)
-    // contain either a 'return' or an 'exit()'.
 }
 
 // --- Main Program Entry Point ---
 // This is where the server program begins execution.
+// Parses the numeric value of a command line option; 'min' is the smallest accepted.
+static int32 optnum(int opt, char *arg, int32 min) {
+    unsigned long v;
+    char *end;
+
+    errno = 0;
+    v = strtoul(arg, &end, 10);
+    if (!*arg || *end || errno || v < min || v > 0x7fffffffUL) {
+        fprintf(stderr, "Invalid value '%s' for -%c (at least %u).\n", arg, opt, min);
+        exit(EXIT_FAILURE);
+    }
+    return (int32)v;
+}
+
 int main(int argc, char *argv[]) {
     char *sport;
+    char *upath; // Path of the Unix domain socket ("" disables it).
     int16 port;
-    int s; // File descriptor for the main listening socket.
+    int16 n;
+    int opt;
+    struct sigaction sa;
+
+    // 1. Parse the command line:
+    //    cache22_server [-u unix_socket_path] [-c max_connections] [-b backlog]
+    //                   [-i idle_seconds] [-o output_limit_bytes] [port]
+    upath = SOCKPATH;
+    while ((opt = getopt(argc, argv, "u:c:b:i:o:")) != -1) {
+        switch (opt) {
+            case 'u':
+                upath = optarg;
+                break;
+            case 'c':
+                maxconns = optnum(opt, optarg, 1);
+                break;
+            case 'b':
+                backlog = optnum(opt, optarg, 1);
+                break;
+            case 'i':
+                idletimeout = optnum(opt, optarg, 0);
+                break;
+            case 'o':
+                outlimit = optnum(opt, optarg, OutChunk);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-u unix_socket_path] [-c max_connections] [-b backlog] "
+                    "[-i idle_seconds] [-o output_limit_bytes] [port]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
 
-    // 1. Determine the port number for the server:
-    // If no command-line argument is provided (argc < 2), use the default PORT defined in cache22.h.
-    // Otherwise, use the first command-line argument (argv[1]) as the port string.
-    if (argc < 2) {
-        sport = PORT;
+    // Reap children as they exit, which also keeps the count of open connections.
+    // poll() and io_uring_enter() still return EINTR despite SA_RESTART; their loops retry.
+    zero((int8 *)&sa, sizeof(sa));
+    sa.sa_handler = onchild;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Determine the port number for the server:
+    // If no port argument is provided, use the default PORT defined in cache22.h.
+    if (optind < argc) {
+        sport = argv[optind];
     } else {
-        sport = argv[1];
+        sport = PORT;
     }
     port = (int16)atoi(sport); // Convert the port string (e.g., "12049") to an integer.
 
-    // --- REMOVED TEST BLOCK ---
-    // The previous test block for getcmd is removed.
-    // This ensures the server initialization and main loop execute.
+    // 2. Map the change-notification ring before any child is forked, so all of them share it.
+    if (watch_init() < 0)
+        perror("watch_init (WATCH disabled)");
 
-    // 2. Initialize the server's listening socket:
-    s = initserver(port); // Call 'initserver' to set up the server socket.
+    // 3. Initialize the server's listening sockets:
+    listeners[nlisteners++] = initserver(port); // TCP, as always.
+    if (*upath)
+        listeners[nlisteners++] = initunix(upath); // Plus the Unix domain socket for local clients.
 
-    // 3. Enter the main server loop:
-    // This loop continuously calls 'mainloop' to accept new client connections.
+    // 4. Enter the main server loop:
+    // Accept through io_uring when the kernel supports it; uring_mainloop() only
+    // returns once the server stops. Otherwise, loop over the blocking 'mainloop'.
     scontinuation = true; // Set the flag to 'true' to start the loop.
-    while (scontinuation) {
-        mainloop(s); // Call 'mainloop', which will block until a client connects.
+    if (uring_mainloop() < 0) {
+        while (scontinuation) {
+            mainloop(); // Call 'mainloop', which will block until a client connects.
+        }
     }
 
-    // 4. Server Shutdown:
+    // 5. Server Shutdown:
     // These lines are only executed if 'scontinuation' becomes 'false' (e.g., if a signal handler
     // for Ctrl+C were implemented to set it to 'false').
     printf("Server: Shutting down...\n");
-    close(s); // Close the main listening socket, releasing its resources.
+    for (n = 0; n < nlisteners; n++)
+        close(listeners[n]); // Close the listening sockets, releasing their resources.
+    if (*upath)
+        unlink(upath);
     return 0; // Program exits successfully.
-}
\ No newline at end of file
+}
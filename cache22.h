@@ -15,10 +15,27 @@
 #include<arpa/inet.h>
 #include<sys/socket.h>
 #include<netinet/in.h>
+#include<sys/un.h>
+#include<sys/stat.h>
+#include<poll.h>
+#include<signal.h>
+#include<sys/wait.h>
+#include<time.h>
+#include<limits.h>
 
 
 #define HOST   "127.0.0.1"
 #define PORT    "12049"
+#define SOCKPATH "/tmp/cache22.sock" /* default Unix domain socket, '-u' overrides */
+#define MaxListeners 2               /* TCP + Unix domain socket */
+#define OutChunk 4096 /* initial size of a client's output buffer */
+#define Backlog     128   /* default listen() backlog, '-b' overrides */
+#define MaxConns    256   /* default limit on connections served at once, '-c' overrides */
+#define IdleTimeout 300   /* default seconds of inactivity before a connection is closed, '-i' (0: never) */
+#define WatchIdle   12    /* watchers get this many idle timeouts (an hour by default) */
+#define OutLimit    65536 /* default bytes of replies queued before they must go out, '-o' overrides */
+#define MultiLines  1024  /* commands one MULTI may queue */
+#define MultiBytes  65536 /* and bytes of them */
 
 typedef unsigned int int32;
 typedef unsigned short int int16;
@@ -30,9 +47,48 @@ struct s_client{
     char ip[16];
     int16 port;
 
+    int8 *out;      /* replies queued for the next flush */
+    int32 outlen;
+    int32 outcap;
+    time_t last;    /* last input or output progress, CLOCK_MONOTONIC seconds */
+
+    int8 in[256];   /* received start of a line whose '\n' has not arrived yet */
+    int16 inlen;
+    bool inskip;    /* dropping the rest of a line too long for 'in' */
+
+    struct s_shm *shm;  /* shared-memory transport, once the client sent SHM */
+    char shmname[32];
+    bool shmlinked;     /* 'shmname' still exists: until the client's first request in the ring */
+
+    struct s_node *cwd; /* folder set by CD (0: root), valid while 'drops' == cwddrops */
+    int32 cwddrops;
+    int8 cwdpath[256];  /* to find it again after a folder was dropped */
+
+    struct s_watcher *watch; /* subtrees under WATCH and the event read position, or 0 */
+
+    struct s_multi *multi; /* lines queued since MULTI, or 0 outside of one */
 };
 typedef struct s_client Client;
 
+/* commands queued between MULTI and EXEC */
+struct s_multi {
+    int8 *lines;        /* one after the other, each null-terminated */
+    int32 len;
+    int32 cap;
+    int16 n;
+    bool bad;           /* a line was rejected, so EXEC refuses the batch */
+};
+typedef struct s_multi Multi;
+
+/* a key as EXEC expects it at some point of the batch, before running any of it */
+struct s_expect {
+    int8 path[256];     /* absolute */
+    int8 key[128];      /* "" for a folder dropped by the batch */
+    long long version;  /* 0: missing, -1: unknown (changed by a command that may fail) */
+    bool made;          /* a write of the batch creates 'path' (and the folders above) */
+};
+typedef struct s_expect Expect;
+
 typedef int32 (*Callback)(Client *,int8*,int8*);
 struct s_cmdhandler{
     int8 *cmd;
@@ -41,9 +97,53 @@ struct s_cmdhandler{
 
 typedef struct s_cmdhandler CmdHandler;
 
+/* slots of handlers[], picked by the perfect hash in getcmd() */
+enum e_cmdslot{
+    CmdHello,
+    CmdGet,
+    CmdPut,
+    CmdCd,
+    CmdLs,
+    CmdQuit,
+    CmdPrintTree,
+    CmdShm,
+    CmdIncr,
+    CmdIncrBy,
+    CmdDecr,
+    CmdAppend,
+    CmdCompress,
+    CmdDel,
+    CmdWatch,
+    CmdUnwatch,
+    CmdGetV,
+    CmdCas,
+    CmdMulti,
+    CmdExec,
+    CmdDiscard,
+    CmdNone
+};
+typedef enum e_cmdslot CmdSlot;
+
 void assert_perror(int system_call_return_value);
+Callback getcmd(int8*,int16);
+int16 tokenize(int8*,int8**,int8**,int8**);
+void cwrite(Client*,int8*,int32);
+void cprintf(Client*,const char*,...) __attribute__((format(printf,2,3)));
+int cflush(Client*);
+void dispatch(Client*,int8*);
+void receive(Client*,int8*,int32);
+time_t monotime(void);
+int idle_ms(Client*);
+int wait_ms(Client*);
+void reap_idle(Client*);
 void childloop(Client*);
-void mainloop(int s);
+void spawn(int,struct sockaddr*);
+void mainloop(void);
 int initserver(int16);
+int initunix(char*);
+
+extern int listeners[MaxListeners];
+extern int16 nlisteners;
+extern int32 maxconns, backlog, idletimeout, outlimit;
 
 #endif
@@ -0,0 +1,203 @@
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "lz.h"
+
+/*
+ * Positions are "virtual": the dictionary occupies [0, dsize) and the data
+ * follows at [dsize, dsize + n), so one offset can point into either.
+ */
+#define Hash(p) ((((int32)(p)[0] | (int32)(p)[1] << 8 | (int32)(p)[2] << 16 | (int32)(p)[3] << 24) \
+        * 2654435761u) >> (32 - LzHashBits))
+#define At(v) (((v) < dsize) ? dict[(v)] : src[(v) - dsize])
+
+/* length bytes past a saturated nibble */
+static bool putlen(int8 *dst, int32 *out, int32 cap, int32 len) {
+    for (; len >= 255; len -= 255) {
+        if (*out >= cap)
+            return false;
+        dst[(*out)++] = 255;
+    }
+    if (*out >= cap)
+        return false;
+    dst[(*out)++] = (int8)len;
+    return true;
+}
+
+/* one sequence; 'mlen' 0 writes the final, literals-only sequence */
+static bool emit(int8 *dst, int32 *out, int32 cap, int8 *lit, int32 nlit, int32 off, int32 mlen) {
+    int32 m;
+
+    m = mlen ? mlen - LzMinMatch : 0;
+    if (*out >= cap)
+        return false;
+    dst[(*out)++] = (int8)(((nlit < 15) ? nlit : 15) << 4 | ((m < 15) ? m : 15));
+    if (nlit >= 15 && !putlen(dst, out, cap, nlit - 15))
+        return false;
+    if (*out + nlit > cap)
+        return false;
+    memcpy(dst + *out, lit, nlit);
+    *out += nlit;
+    if (!mlen)
+        return true;
+
+    if (*out + 2 > cap)
+        return false;
+    dst[(*out)++] = (int8)off;
+    dst[(*out)++] = (int8)(off >> 8);
+    return (m < 15) || putlen(dst, out, cap, m - 15);
+}
+
+#define TableOff(size) (((size) + 3) & ~(int32)3)
+#define TableBytes     ((int32)sizeof(int32) << LzHashBits)
+
+/*
+ * An empty dictionary for 'size' bytes of data, with room for the table when
+ * it is worth keeping. The caller fills 'data' (setting 'size') and calls
+ * lz_train(); free() releases it all.
+ */
+Dict *lz_dict(int32 size) {
+    Dict *d;
+    bool table;
+
+    table = size >= DictTable;
+    d = (Dict *)malloc(sizeof(Dict) + (table ? TableOff(size) + TableBytes : size));
+    if (!d)
+        return (Dict *)0;
+    d->refs = 1;
+    d->size = 0;
+    d->table = table ? (int32 *)(d->data + TableOff(size)) : (int32 *)0;
+    return d;
+}
+
+/* memory taken by a dictionary made by lz_dict() */
+int32 lz_dictbytes(Dict *d) {
+    return (int32)sizeof(Dict) + (d->table ? (int32)((int8 *)d->table - d->data) + TableBytes : d->size);
+}
+
+/* hash every position of the dictionary into 'table' */
+static void index_dict(Dict *d, int32 *table) {
+    int32 i;
+
+    memset(table, 0xff, TableBytes);
+    for (i = 0; i + LzMinMatch <= d->size; i++)
+        table[Hash(d->data + i)] = i;
+}
+
+/*
+ * Index the dictionary once its data is in place, so every compression with
+ * it can start from a copy of the table instead of hashing every position.
+ * Small dictionaries are cheap to hash again each time and keep no table.
+ */
+void lz_train(Dict *d) {
+    if (d->table)
+        index_dict(d, d->table);
+}
+
+/*
+ * Compress 'n' bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the compressed size, or 0 when it does not fit in 'cap'
+ * (the caller then keeps the data uncompressed).
+ */
+int32 lz_compress(Dict *d, int8 *src, int32 n, int8 *dst, int32 cap) {
+    int32 table[1 << LzHashBits];
+    int8 *dict;
+    int32 dsize, i, j, anchor, ref, len, out, h;
+
+    dict = d ? d->data : (int8 *)0;
+    dsize = d ? d->size : 0;
+    if (d && d->table)
+        memcpy(table, d->table, sizeof(table));
+    else if (d)
+        index_dict(d, table);
+    else
+        memset(table, 0xff, sizeof(table));
+
+    for (i = anchor = out = 0; i + LzMinMatch <= n;) {
+        h = Hash(src + i);
+        ref = table[h];
+        table[h] = dsize + i;
+        if (ref == (int32)-1 || dsize + i - ref > LzMaxOff
+                || At(ref) != src[i] || At(ref + 1) != src[i + 1]
+                || At(ref + 2) != src[i + 2] || At(ref + 3) != src[i + 3]) {
+            i++;
+            continue;
+        }
+
+        for (len = LzMinMatch; i + len < n && At(ref + len) == src[i + len]; len++);
+        if (!emit(dst, &out, cap, src + anchor, i - anchor, dsize + i - ref, len))
+            return 0;
+        for (j = i + 1; j < i + len && j + LzMinMatch <= n; j++)
+            table[Hash(src + j)] = dsize + j;
+        i += len;
+        anchor = i;
+    }
+
+    if (!emit(dst, &out, cap, src + anchor, n - anchor, 0, 0))
+        return 0;
+    return out;
+}
+
+/* length bytes past a saturated nibble, -1 if the stream ends early */
+static int getlen(int8 *src, int32 n, int32 *ip) {
+    int len;
+    int8 b;
+
+    len = 0;
+    do {
+        if (*ip >= n)
+            return -1;
+        b = src[(*ip)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/*
+ * Decompress 'n' bytes at 'src' into at most 'cap' bytes at 'dst' using the
+ * dictionary they were compressed with. Returns the output size, or -1 if the
+ * stream is corrupt or does not fit.
+ */
+int lz_decompress(Dict *d, int8 *src, int32 n, int8 *dst, int32 cap) {
+    int8 *dict;
+    int32 dsize, ip, op, off, v, end;
+    int lit, mlen, ext;
+    int8 tok;
+
+    dict = d ? d->data : (int8 *)0;
+    dsize = d ? d->size : 0;
+    for (ip = op = 0; ip < n;) {
+        tok = src[ip++];
+        lit = tok >> 4;
+        if (lit == 15) {
+            if ((ext = getlen(src, n, &ip)) < 0)
+                return -1;
+            lit += ext;
+        }
+        if (ip + lit > n || op + lit > cap)
+            return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n)
+            break;
+
+        if (ip + 2 > n)
+            return -1;
+        off = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        mlen = (tok & 15) + LzMinMatch;
+        if ((tok & 15) == 15) {
+            if ((ext = getlen(src, n, &ip)) < 0)
+                return -1;
+            mlen += ext;
+        }
+        if (!off || off > dsize + op || op + mlen > cap)
+            return -1;
+
+        // Byte by byte: the match may overlap its own output or start in the dictionary.
+        for (v = dsize + op - off, end = op + mlen; op < end; v++, op++)
+            dst[op] = (v < dsize) ? dict[v] : dst[v - dsize];
+    }
+    return (int)op;
+}
@@ -0,0 +1,43 @@
+#ifndef LZ
+#define LZ
+
+/*
+ * Small LZ77 codec with a preset dictionary, used for compressed leaves.
+ * The stream is a series of sequences, LZ4 style:
+ *   token        high nibble literal count, low nibble match length - LzMinMatch
+ *                (15 in either nibble: more length bytes follow, each adding up
+ *                to 255, until one is below 255)
+ *   literals
+ *   offset       2 bytes little endian, distance back from the current output
+ *                position; it may reach into the dictionary, which sits right
+ *                before the output
+ *   match length extension bytes, if any
+ * The last sequence has literals only and ends the stream.
+ */
+typedef unsigned int int32;
+typedef unsigned short int int16;
+typedef unsigned char int8;
+
+#define LzMinMatch 4
+#define LzHashBits 12
+#define LzMaxOff   65535
+#define DictSize   16384 /* at most this many bytes of sample data in a folder dictionary */
+#define DictSample 1024  /* at most this much is taken from any one leaf */
+#define DictTable  4096  /* smaller dictionaries keep no hash table (it alone takes 16 KB) */
+
+struct s_dict {
+    int32 refs;     /* the node using it plus every leaf compressed with it */
+    int32 size;
+    int32 *table;   /* last dictionary position of each hash, built by lz_train(); 0 below DictTable */
+    int8 data[];    /* 'size' bytes, allocated to fit what was sampled; the table follows */
+};
+typedef struct s_dict Dict;
+
+Dict *lz_dict(int32);
+int32 lz_dictbytes(Dict*);
+
+void lz_train(Dict*);
+int32 lz_compress(Dict*,int8*,int32,int8*,int32);
+int lz_decompress(Dict*,int8*,int32,int8*,int32);
+
+#endif
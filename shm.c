@@ -0,0 +1,249 @@
+#include "shm.h"
+#include "tree.h"
+#include "watch.h"
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+extern bool ccontinuation;
+
+#define RingMask  (ShmRingSize - 1)
+#define YieldMask 63 /* give the CPU away every 64 empty polls */
+
+/*
+ * Create this connection's shared memory object and map it.
+ * The name is unique per child process, so two sessions never share rings;
+ * one still there was left by a crashed process that had the same pid.
+ */
+int shm_attach(Client *cli) {
+    Shm *m;
+    int fd;
+
+    snprintf(cli->shmname, sizeof(cli->shmname), "/cache22.%d", (int)getpid());
+    shm_unlink(cli->shmname);
+    fd = shm_open(cli->shmname, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(Shm)) < 0) {
+        close(fd);
+        shm_unlink(cli->shmname);
+        return -1;
+    }
+    m = (Shm *)mmap(0, sizeof(Shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        shm_unlink(cli->shmname);
+        return -1;
+    }
+
+    // ftruncate() zero-filled both rings; publish the header last.
+    m->size = sizeof(Shm);
+    __atomic_store_n(&m->magic, ShmMagic, __ATOMIC_RELEASE);
+    cli->shm = m;
+    cli->shmlinked = true;
+    return 0;
+}
+
+/* remove the object's name, once it is no longer needed to map it */
+static void shm_unname(Client *cli) {
+    if (!cli->shmlinked)
+        return;
+    shm_unlink(cli->shmname);
+    cli->shmlinked = false;
+}
+
+/*
+ * Remove the object a child that died from a signal may have left before its
+ * client's first request. Runs in the SIGCHLD handler, hence no snprintf().
+ */
+void shm_reap(pid_t pid) {
+    char name[32] = "/cache22.", digits[12];
+    int16 n, i;
+
+    for (n = 0; pid > 0 && n < (int16)sizeof(digits); pid /= 10)
+        digits[n++] = (char)('0' + pid % 10);
+    for (i = 9; n && i < (int16)sizeof(name) - 1; i++)
+        name[i] = digits[--n];
+    name[i] = '\0';
+    shm_unlink(name);
+}
+
+void shm_detach(Client *cli) {
+    if (!cli->shm)
+        return;
+    munmap(cli->shm, sizeof(Shm));
+    shm_unname(cli);
+    cli->shm = (Shm *)0;
+}
+
+/*
+ * Take the next complete line out of 'q' into 'line' (at most max-1 bytes,
+ * the rest of a longer line is dropped, as receive() does for the socket).
+ * Returns false while no full line is there yet.
+ */
+static bool shm_getline(ShmRing *q, int8 *line, int32 max) {
+    int32 head, tail, i, n;
+    int8 c;
+
+    head = q->head;
+    tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    for (i = head, n = 0; i != tail; i++) {
+        c = q->data[i & RingMask];
+        if (c == '\n')
+            break;
+        if (n < max - 1)
+            line[n++] = c;
+    }
+
+    // No newline yet: wait for the rest, unless the ring is full of one line.
+    if (i == tail && tail - head < ShmRingSize)
+        return false;
+
+    line[n] = '\0';
+    __atomic_store_n(&q->head, (i == tail) ? tail : i + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* the client closed its socket (or it failed), which ends the session */
+static bool shm_gone(Client *cli) {
+    int8 c;
+    ssize_t n;
+
+    n = recv(cli->s, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return !n || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/*
+ * Move everything queued in cli->out into the response ring.
+ * Waits for the client to drain the ring when it is full, at most until the
+ * connection counts as idle.
+ */
+static int shm_put(Client *cli, ShmRing *q) {
+    struct timespec nap = {0, ShmNap};
+    int32 off, head, tail, n, first;
+
+    for (off = 0; off < cli->outlen; off += n) {
+        tail = q->tail;
+        head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        n = ShmRingSize - (tail - head);
+        if (!n) {
+            if (shm_gone(cli) || !idle_ms(cli))
+                return -1;
+            nanosleep(&nap, 0);
+            continue;
+        }
+        if (n > cli->outlen - off)
+            n = cli->outlen - off;
+
+        // Copy in at most two pieces, around the end of the ring.
+        first = ShmRingSize - (tail & RingMask);
+        if (first > n)
+            first = n;
+        memcpy(q->data + (tail & RingMask), cli->out + off, first);
+        memcpy(q->data, cli->out + off + first, n - first);
+        __atomic_store_n(&q->tail, tail + n, __ATOMIC_RELEASE);
+        cli->last = monotime();
+    }
+    cli->outlen = 0;
+    return 0;
+}
+
+int shm_flush(Client *cli) {
+    return shm_put(cli, &cli->shm->resp);
+}
+
+/*
+ * Sleep until the client moves req.tail away from 'tail' (and rings), or for
+ * 'ns' nanoseconds. 'waiting' is set before 'tail' was read, so a client that
+ * publishes after that read also sees the flag and wakes us.
+ * Returns true if the tail moved.
+ */
+static bool shm_sleep(Shm *m, int32 tail, long ns) {
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+
+#ifdef __linux__
+    syscall(SYS_futex, &m->req.tail, FUTEX_WAIT, tail, &ts, 0, 0);
+#else
+    nanosleep(&ts, 0);
+#endif
+    return __atomic_load_n(&m->req.tail, __ATOMIC_ACQUIRE) != tail;
+}
+
+/*
+ * Client loop once the connection switched to shared memory.
+ * The server polls the request ring in a tight loop while requests keep coming,
+ * yielding now and then, and only after ShmSpins empty polls goes to sleep
+ * until the client rings (see shm.h), or for a growing nap if it does not.
+ * Between sleeps it also watches the socket: a hangup ends the session, and
+ * lines sent there are still served (with the replies on the socket).
+ * Changes under watched subtrees are pushed through the response ring; their
+ * waiter thread rings req.tail like the client does (see watch.h), and where
+ * it cannot the sleep never outlasts a WatchTick while watching. Nor does it
+ * outlast the idle timeout.
+ * An idle session is closed once it is sleeping.
+ */
+void shmloop(Client *cli) {
+    Shm *m = cli->shm;
+    int8 line[256];
+    int32 spins, seen;
+    long nap, ns;
+    int wait;
+    ssize_t n;
+
+    watch_wakes(&m->req.tail);
+    for (spins = 0, nap = ShmNap; ccontinuation;) {
+        if (watch_push(cli) && shm_put(cli, &cli->shm->resp) < 0)
+            break;
+        seen = __atomic_load_n(&m->req.tail, __ATOMIC_ACQUIRE);
+        if (shm_getline(&cli->shm->req, line, sizeof(line))) {
+            shm_unname(cli); // The client has it mapped.
+            dispatch(cli, line);
+            if (shm_put(cli, &cli->shm->resp) < 0)
+                break;
+            spins = 0;
+            nap = ShmNap;
+            continue;
+        }
+        if (++spins < ShmSpins) {
+            // On a busy or single-CPU host the client may need this core to make progress.
+            if (!(spins & YieldMask))
+                sched_yield();
+            continue;
+        }
+
+        n = recv(cli->s, (char *)line, sizeof(line), MSG_DONTWAIT);
+        if (!n) {
+            printf("Server: Client %s:%d disconnected gracefully.\n", cli->ip, cli->port);
+            break;
+        } else if (n > 0) {
+            receive(cli, line, (int32)n);
+            if (cflush(cli) < 0)
+                break;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("Error reading from client socket");
+            break;
+        }
+        if (!idle_ms(cli)) {
+            reap_idle(cli);
+            cflush(cli);
+            break;
+        }
+
+        // Sleep no longer than the client loop may wait, and only on the tail already
+        // looked at: anything published after it was either seen here or rings.
+        wait = wait_ms(cli);
+        ns = (wait >= 0 && wait < nap / 1000000) ? wait * 1000000L : nap;
+        __atomic_store_n(&m->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m->req.tail, __ATOMIC_SEQ_CST) != seen || shm_sleep(m, seen, ns))
+            nap = ShmNap;
+        else if (nap < ShmNapMax)
+            nap = (nap * 2 < ShmNapMax) ? nap * 2 : ShmNapMax;
+        __atomic_store_n(&m->waiting, 0, __ATOMIC_RELAXED);
+    }
+    watch_wakes((int32 *)0);
+}
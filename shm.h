@@ -0,0 +1,57 @@
+#ifndef SHM
+#define SHM
+#include "cache22.h"
+
+/*
+ * Shared-memory transport for clients on the same host.
+ * After "SHM" the server replies "OK: SHM <name> <size>" over the socket,
+ * where <name> is a POSIX shared memory object laid out as a Shm.
+ * The client maps it, writes '\n' terminated command lines into 'req' and
+ * polls 'resp' for the replies, which are the same bytes the socket would
+ * carry (prompt included). The socket stays open; closing it ends the session.
+ * The first request read from the ring shows the client mapped the object, and
+ * the server removes its name right then, so a crash later cannot leak it.
+ *
+ * Both rings are single-producer/single-consumer byte rings. 'head' and 'tail'
+ * only ever grow and are indexed modulo ShmRingSize; the producer publishes
+ * 'tail' with a release store after writing data, the consumer publishes
+ * 'head' the same way after reading it.
+ *
+ * Once the request ring stayed empty for ShmSpins polls the server goes to
+ * sleep on 'req.tail' (a futex) and sets 'waiting'. A client that finds
+ * 'waiting' set after publishing 'tail' wakes it with FUTEX_WAKE on 'req.tail'
+ * (the object is shared, so not FUTEX_PRIVATE_FLAG). Clients that never ring
+ * are still served: the sleep starts at ShmNap and doubles up to ShmNapMax.
+ */
+#define ShmMagic    0x53323243 /* "C22S" */
+#define ShmRingSize 65536      /* bytes per direction, power of 2 */
+#define ShmSpins    100000     /* empty polls before the server goes to sleep */
+#define ShmNap      20000      /* nanoseconds of the first sleep once idle */
+#define ShmNapMax   50000000   /* and of the longest, without a wake-up (50 ms) */
+
+struct s_shmring {
+    int32 head;         /* consumer position */
+    int8 pad1[60];      /* keep head and tail on separate cache lines */
+    int32 tail;         /* producer position */
+    int8 pad2[60];
+    int8 data[ShmRingSize];
+};
+typedef struct s_shmring ShmRing;
+
+struct s_shm {
+    int32 magic;        /* ShmMagic, stored last once the rings are ready */
+    int32 size;         /* sizeof(Shm), so a client can check its layout */
+    int32 waiting;      /* 1 while the server sleeps on req.tail: wake it */
+    int8 pad[52];
+    ShmRing req;        /* client -> server: command lines */
+    ShmRing resp;       /* server -> client: replies */
+};
+typedef struct s_shm Shm;
+
+int shm_attach(Client*);
+void shm_detach(Client*);
+void shm_reap(pid_t);
+int shm_flush(Client*);
+void shmloop(Client*);
+
+#endif
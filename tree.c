@@ -1,6 +1,8 @@
 #include "tree.h"
 // tree.c (at global scope, after includes)
 Nullptr my_null = 0; // <-- Add this definition here
+static int8 zbuf[MaxValue+1]; /* raw value of the last compressed leaf read */
+int32 drops = 0;
 Tree root={.n={
     .tag=(TagRoot | TagNode),
     .north=(Node*) &root,
@@ -9,12 +11,15 @@ Tree root={.n={
     .path= "/"
 }};
 
-void print_tree_forward_leaves(int fd, Tree * _root){
+void print_tree_forward_leaves(Sink out, void *ctx, Tree * _root){
     int8 indentation;
     int8 buf[256]; // Buffer for the Print macro
     int16 size;    // Size for the Print macro
     Node *n;       // Pointer for Node traversal
     Leaf *l;       // Pointer for Leaf traversal
+    int8 num[NumSize]; // Rendering of integer leaves
+    int8 *value;   // Value bytes of the current leaf
+    int16 vsize;   // and their count
 
     indentation = 0; 
 
@@ -37,7 +42,8 @@ void print_tree_forward_leaves(int fd, Tree * _root){
                 Print(l->key);              // Print the Leaf's key (e.g., manan)
                 Print(" ->'");
                 // Directly write the value, as Print macro is for string literals/char arrays
-                write(fd, (char *)l->value, (int)l->size); // Write the raw value data
+                value = leaf_value(l, num, &vsize);
+                out(ctx, value, vsize); // Write the raw value data
                 Print("'\n"); // Newline after the Leaf entry
             }
         }
@@ -84,6 +90,8 @@ Node *create_node(Node* parent,int8 *path){
     size=sizeof(struct s_node);
     n=(Node*)malloc((int )size);
     zero((int8 *)n,size);
+    // insert right after the parent, keeping whatever already followed it in the chain
+    n->west=parent->west;
     parent->west=n;
     n->tag=TagNode;
     n->north=parent;
@@ -102,11 +110,15 @@ Node *find_node_linear(int8 *path){
 }
 Leaf *find_leaf_linear(int8 *path,int8 *key){
     Node *n;
-    Leaf *l,*ret;
     n=find_node(path);
     if(!n)
         return (Leaf *)0;
     
+    return find_leaf_in(n,key);
+}
+Leaf *find_leaf_in(Node *n,int8 *key){
+    Leaf *l,*ret;
+    assert(n);
     for(ret =(Leaf *)0,l=n->east;l;l=l->east)
         if(!strcmp((char *)l->key,(char *)key)){
             ret=l;
@@ -157,13 +169,285 @@ Leaf *create_leaf(Node *parent,int8 *key,int8 *value,int16 count){
     (Tree *)l;
 
     strncpy((char *)new->key,(char *)key,127);
-    new->value=(int8 *)malloc(count);
-    zero(new->value,count);
+    new->value=(int8 *)malloc(count+1);
     assert(new->value);
+    zero(new->value,count+1);
     strncpy((char *)new->value,(char * )value,count);
     new->size=count;
+    new->cap=count+1;
+    new->version=1;
     return new;
 }
+/* make room for 'count' value bytes (plus the terminator), growing geometrically */
+static bool reserve_leaf(Leaf *l,int16 count){
+    int32 cap;
+    int8 *p;
+    if(count>MaxValue)
+        return false;
+    if(count<l->cap)
+        return true;
+
+    for(cap=(l->cap)?l->cap:16;cap<=count;cap*=2);
+    if(cap>MaxValue+1)
+        cap=MaxValue+1;
+    p=(int8 *)realloc(l->value,cap);
+    if(!p)
+        return false;
+    l->value=p;
+    l->cap=(int16)cap;
+    return true;
+}
+static void drop_dict(Dict *d){
+    if(d&&!--d->refs)
+        free(d);
+}
+/* replace the value, reusing the old buffer when it is big enough */
+Leaf *set_leaf(Leaf *l,int8 *value,int16 count){
+    errno=NoError;
+    assert(l);
+    if(l->tag&TagZip){
+        drop_dict(l->dict);
+        l->dict=(Dict *)0;
+        l->tag&=~TagZip;
+    }
+    if(!reserve_leaf(l,count)){
+        reterr(ENOMEM);
+    }
+    memcpy(l->value,value,count);
+    l->value[count]=0;
+    l->size=count;
+    l->tag&=~TagInt;
+    l->version++;
+    return l;
+}
+/* append to the value; amortized O(count) thanks to reserve_leaf() */
+Leaf *append_leaf(Leaf *l,int8 *value,int16 count){
+    int8 num[NumSize];
+    int16 size;
+    int8 *cur;
+    int32 version;
+    errno=NoError;
+    assert(l);
+    version=l->version;
+    unzip_leaf(l);
+    if(l->tag&TagInt){
+        cur=leaf_value(l,num,&size);
+        if(!set_leaf(l,cur,size))
+            return (Leaf *)0;
+    }
+    if((int32)l->size+count>MaxValue){
+        reterr(ERANGE);
+    }
+    if(!reserve_leaf(l,l->size+count)){
+        reterr(ENOMEM);
+    }
+    memcpy(l->value+l->size,value,count);
+    l->size+=count;
+    l->value[l->size]=0;
+    l->version=version+1;
+    return l;
+}
+/* add 'delta' to an integer leaf; a string leaf is parsed once and stays native */
+Leaf *incr_leaf(Leaf *l,long long delta){
+    long long n;
+    char *end;
+    errno=NoError;
+    assert(l);
+    if(l->tag&TagZip){
+        reterr(EINVAL);
+    }
+    if(!(l->tag&TagInt)){
+        if(!l->size)
+            n=0;
+        else{
+            n=strtoll((char *)l->value,&end,10);
+            if(errno||end!=(char *)l->value+l->size){
+                reterr(EINVAL);
+            }
+        }
+        l->num=n;
+        l->tag|=TagInt;
+    }
+    if(__builtin_add_overflow(l->num,delta,&n)){
+        reterr(ERANGE);
+    }
+    l->num=n;
+    l->version++;
+    return l;
+}
+/* the value bytes of a leaf; integer leaves are rendered into 'num' (NumSize bytes),
+   compressed ones into a static buffer that the next call reuses */
+int8 *leaf_value(Leaf *l,int8 *num,int16 *size){
+    int n;
+    assert(l);
+    if(l->tag&TagInt){
+        *size=(int16)snprintf((char *)num,NumSize,"%lld",l->num);
+        return num;
+    }
+    if(l->tag&TagZip){
+        n=lz_decompress(l->dict,l->value,l->zsize,zbuf,MaxValue);
+        assert(n==l->size);
+        *size=l->size;
+        return zbuf;
+    }
+    *size=l->size;
+    return l->value;
+}
+/* compress the value with 'd' if it is big enough and actually shrinks */
+Leaf *zip_leaf(Leaf *l,Dict *d){
+    static int8 out[MaxValue];
+    int32 n;
+    int8 *p;
+    errno=NoError;
+    assert(l);
+    if(!d||(l->tag&(TagInt|TagZip))||l->size<ZipMin)
+        return l;
+
+    n=lz_compress(d,l->value,l->size,out,l->size-1);
+    if(!n)
+        return l;
+    p=(int8 *)realloc(l->value,n);
+    if(!p)
+        return l;
+    memcpy(p,out,n);
+    l->value=p;
+    l->cap=(int16)n;
+    l->zsize=(int16)n;
+    l->dict=d;
+    d->refs++;
+    l->tag|=TagZip;
+    return l;
+}
+/* store the value uncompressed again */
+void unzip_leaf(Leaf *l){
+    int8 *raw,*p;
+    int16 size;
+    assert(l);
+    if(!(l->tag&TagZip))
+        return;
+
+    raw=leaf_value(l,(int8 *)0,&size);
+    p=(int8 *)malloc(size+1);
+    assert(p);
+    memcpy(p,raw,size);
+    p[size]=0;
+    free(l->value);
+    l->value=p;
+    l->cap=size+1;
+    drop_dict(l->dict);
+    l->dict=(Dict *)0;
+    l->tag&=~TagZip;
+}
+/* raw-content dictionary: the start of each current value of the folder, up to DictSize;
+   allocated for just the bytes it samples */
+static Dict *train_dict(Node *n){
+    Dict *d;
+    Leaf *l;
+    int8 *v;
+    int16 size;
+    int32 take,total;
+    for(total=0,l=n->east;l&&total<DictSize;l=l->east)
+        if(!(l->tag&TagInt))
+            total+=(l->size<DictSample)?l->size:DictSample;
+    if(total>DictSize)
+        total=DictSize;
+    d=lz_dict(total);
+    if(!d)
+        return (Dict *)0;
+    for(l=n->east;l&&d->size<total;l=l->east){
+        if(l->tag&TagInt)
+            continue;
+        v=leaf_value(l,(int8 *)0,&size);
+        take=(size<DictSample)?size:DictSample;
+        if(take>total-d->size)
+            take=total-d->size;
+        memcpy(d->data+d->size,v,take);
+        d->size+=take;
+    }
+    lz_train(d);
+    return d;
+}
+/* turn compression of a folder on (training a fresh dictionary) or off;
+   returns how many of its leaves ended up compressed */
+int32 compress_node(Node *n,bool on){
+    Leaf *l;
+    int32 count;
+    errno=NoError;
+    assert(n);
+    for(l=n->east;l;l=l->east)
+        unzip_leaf(l);
+    drop_dict(n->dict);
+    n->dict=(Dict *)0;
+    if(!on)
+        return 0;
+
+    n->dict=train_dict(n);
+    if(!n->dict){
+        errno=ENOMEM;
+        return 0;
+    }
+    for(count=0,l=n->east;l;l=l->east)
+        if(zip_leaf(l,n->dict)->tag&TagZip)
+            count++;
+    return count;
+}
+static void free_leaf(Leaf *l){
+    if(l->tag&TagZip)
+        drop_dict(l->dict);
+    free(l->value);
+    free(l);
+}
+/* unlink and free the leaf 'key' of 'n'; false if there is none */
+bool delete_leaf(Node *n,int8 *key){
+    Leaf *l;
+    assert(n);
+    l=find_leaf_in(n,key);
+    if(!l)
+        return false;
+
+    // 'west' is the previous leaf, or the node itself for the first one.
+    if(l->west==(Tree *)n)
+        n->east=l->east;
+    else
+        l->west->l.east=l->east;
+    if(l->east)
+        l->east->west=l->west;
+    free_leaf(l);
+    return true;
+}
+/* remove 'n' and every folder below it, with their leaves; returns the nodes freed.
+   Any Node pointer kept elsewhere may now dangle: 'drops' changes to tell. */
+int32 drop_node(Node *n){
+    Node *p,*m;
+    Leaf *l,*next;
+    int8 path[256];
+    int16 len;
+    int32 count;
+    assert(n);
+    if(n==(Node *)&root)
+        return 0;
+
+    /* 'n' itself is freed along the way: compare against a copy of its path */
+    len=(int16)strlen((char *)n->path);
+    memcpy(path,n->path,len+1);
+    for(count=0,p=(Node *)&root;p->west;){
+        m=p->west;
+        if(strncmp((char *)m->path,(char *)path,len)||(m->path[len]&&m->path[len]!='/')){
+            p=m;
+            continue;
+        }
+        p->west=m->west;
+        for(l=m->east;l;l=next){
+            next=l->east;
+            free_leaf(l);
+        }
+        drop_dict(m->dict);
+        free(m);
+        count++;
+    }
+    drops++;
+    return count;
+}
 int tree_test_main(){
    Node* n,*n2;
    Leaf *l1,*l2;
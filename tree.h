@@ -5,10 +5,17 @@
 #include<string.h>
 #include<assert.h>
 #include<errno.h>
+#include<stdbool.h>
+#include "lz.h"
 #define TagRoot  1 /*00 01*/
 #define TagNode  2 /*00 10*/
 #define TagLeaf  4 /*01 00*/
+#define TagInt   8 /*10 00*/ /* leaf holds a native integer in 'num' */
+#define TagZip  16 /*1 00 00*/ /* leaf value is compressed with 'dict' */
 #define NoError  0
+#define NumSize  24 /* room for a rendered long long */
+#define MaxValue 65534 /* 'cap' is an int16 and counts the null terminator */
+#define ZipMin   64    /* smaller values are never compressed */
 typedef void* Nullptr;
 extern Nullptr my_null; // <-- Change to this
 #define find_last(x)      find_last_linear(x) //used to define a comman function find_last
@@ -24,7 +31,7 @@ extern Nullptr my_null; // <-- Change to this
         strncpy((char*)buf,(char *)(x),256);\
         size=(int16)strlen((char *)buf);\
         if(size)\
-            write(fd,(char*)buf,size)
+            out(ctx,buf,size)
 
 typedef unsigned int int32;
 typedef unsigned short int int16;
@@ -37,6 +44,7 @@ struct s_node {
     struct s_node *west;
     struct s_leaf *east;
     int8 path[256];
+    Dict *dict;     /* compression dictionary of this folder, or 0 when off */
 };
 typedef struct s_node Node;
 struct s_leaf
@@ -47,6 +55,11 @@ struct s_leaf
     int8 key[128];
     int8 *value;
     int16 size;
+    int16 cap;      /* bytes allocated at 'value', null terminator included */
+    long long num;  /* the value while tag has TagInt */
+    Dict *dict;     /* while tag has TagZip: 'value' holds 'zsize' bytes compressed */
+    int16 zsize;    /* with this dictionary, 'size' stays the raw length */
+    int32 version;  /* 1 when created, bumped by every change of the value (CAS) */
 };
 typedef struct s_leaf Leaf;
 union u_tree
@@ -55,9 +68,11 @@ union u_tree
     Leaf l;
 };
 typedef union u_tree Tree;
+typedef void (*Sink)(void*,int8*,int32); /* where print_tree_forward_leaves() writes */
 extern Tree root;
+extern int32 drops; /* bumped by drop_node(), so cached Node pointers can be revalidated */
 int8 *indent(int8);
-void print_tree_forward_leaves(int, Tree*);
+void print_tree_forward_leaves(Sink, void*, Tree*);
 
 Leaf *find_leaf_linear(int8*,int8*);
 int8 *lookup_linear(int8*,int8*);
@@ -67,6 +82,16 @@ Node *find_node_linear(int8*);
 Node *create_node(Node*,int8*);
 Leaf *find_last_linear(Node*);
 Leaf *create_leaf(Node*,int8*,int8*,int16);
+Leaf *find_leaf_in(Node*,int8*);
+Leaf *set_leaf(Leaf*,int8*,int16);
+Leaf *append_leaf(Leaf*,int8*,int16);
+Leaf *incr_leaf(Leaf*,long long);
+int8 *leaf_value(Leaf*,int8*,int16*);
+Leaf *zip_leaf(Leaf*,Dict*);
+void unzip_leaf(Leaf*);
+int32 compress_node(Node*,bool);
+bool delete_leaf(Node*,int8*);
+int32 drop_node(Node*);
 
 
 
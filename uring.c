@@ -0,0 +1,503 @@
+#include "uring.h"
+#include "tree.h"
+#include "shm.h"
+#include "watch.h"
+
+extern bool scontinuation;
+extern bool ccontinuation;
+
+#if defined(__linux__) && !defined(NO_URING)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* user_data tags of our submissions; accepts carry the listener index above the tag */
+#define UdAccept 1
+#define UdRecv   2
+#define UdSend   3
+#define UdTick   4
+#define UdUntick 5
+#define UdWatch  6
+#define UdTag(x)      ((x) & 0xff)
+#define UdListener(x) ((x) >> 8)
+
+struct s_uring {
+    int fd;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqlocal;   /* our private sq tail, published by ring_enter() */
+    unsigned pending;   /* sqes prepared but not submitted yet */
+    void *sqring, *cqring;
+    size_t sqsz, cqsz, sqesz;
+    struct io_uring_buf_ring *br; /* provided recv buffers (client rings only) */
+    int8 *bufs;
+    size_t brsz;
+};
+typedef struct s_uring Uring;
+
+/* the parent's accept ring, torn down in each child by uring_detach() */
+static Uring parent = {.fd = -1};
+
+static int ring_init(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    int8 *sq;
+
+    zero((int8 *)r, sizeof(Uring));
+    zero((int8 *)&p, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cqsz > r->sqsz)
+            r->sqsz = r->cqsz;
+        r->cqsz = r->sqsz;
+    }
+
+    r->sqring = mmap(0, r->sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_SQ_RING);
+    r->cqring = (p.features & IORING_FEAT_SINGLE_MMAP) ?
+        r->sqring :
+    mmap(0, r->cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_CQ_RING);
+    r->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(0, r->sqesz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqring == MAP_FAILED || r->cqring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        r->fd = -1;
+        return -1;
+    }
+
+    sq = (int8 *)r->sqring;
+    r->sqhead = (unsigned *)(sq + p.sq_off.head);
+    r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned *)(sq + p.sq_off.array);
+    r->cqhead = (unsigned *)((int8 *)r->cqring + p.cq_off.head);
+    r->cqtail = (unsigned *)((int8 *)r->cqring + p.cq_off.tail);
+    r->cqmask = (unsigned *)((int8 *)r->cqring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((int8 *)r->cqring + p.cq_off.cqes);
+    r->sqlocal = *r->sqtail;
+
+    return 0;
+}
+
+static void ring_exit(Uring *r) {
+    if (r->fd < 0)
+        return;
+    if (r->br)
+        munmap(r->br, r->brsz);
+    munmap(r->sqes, r->sqesz);
+    if (r->cqring != r->sqring)
+        munmap(r->cqring, r->cqsz);
+    munmap(r->sqring, r->sqsz);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* next free sqe, zeroed; it is submitted by the following ring_enter() */
+static struct io_uring_sqe *ring_sqe(Uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    idx = r->sqlocal & *r->sqmask;
+    sqe = &r->sqes[idx];
+    zero((int8 *)sqe, sizeof(*sqe));
+    r->sqarray[idx] = idx;
+    r->sqlocal++;
+    r->pending++;
+    return sqe;
+}
+
+/* submit everything prepared and wait for at least 'wait' completions */
+static int ring_enter(Uring *r, unsigned wait) {
+    int ret;
+
+    __atomic_store_n(r->sqtail, r->sqlocal, __ATOMIC_RELEASE);
+    ret = (int)syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0)
+        return -1;
+    r->pending -= (unsigned)ret;
+    return 0;
+}
+
+static struct io_uring_cqe *ring_cqe(Uring *r) {
+    unsigned head;
+
+    head = *r->cqhead;
+    if (head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+        return (struct io_uring_cqe *)0;
+    return &r->cqes[head & *r->cqmask];
+}
+
+static void ring_seen(Uring *r) {
+    __atomic_store_n(r->cqhead, *r->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+/* hand buffer 'bid' (back) to the kernel for the next recv */
+static void bufring_put(Uring *r, int16 bid) {
+    struct io_uring_buf *b;
+    int16 tail;
+
+    tail = r->br->tail;
+    b = &r->br->bufs[tail & (UringBufs - 1)];
+    b->addr = (unsigned long)(r->bufs + bid * UringBufSize);
+    b->len = UringBufSize;
+    b->bid = bid;
+    __atomic_store_n(&r->br->tail, (int16)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/* register UringBufs recv buffers as a provided buffer ring */
+static int bufring_init(Uring *r) {
+    struct io_uring_buf_reg reg;
+    size_t ringsz;
+    int16 bid;
+
+    ringsz = UringBufs * sizeof(struct io_uring_buf);
+    r->brsz = ringsz + UringBufs * UringBufSize;
+    r->br = (struct io_uring_buf_ring *)mmap(0, r->brsz, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = 0;
+        return -1;
+    }
+    r->bufs = (int8 *)r->br + ringsz;
+
+    zero((int8 *)&reg, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = UringBufs;
+    reg.bgid = UringBgid;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (bid = 0; bid < UringBufs; bid++)
+        bufring_put(r, bid);
+    return 0;
+}
+
+static void prep_recv(Uring *r, int s, bool multishot) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UringBgid;
+    sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = UdRecv;
+}
+
+static void prep_send(Uring *r, int s, int8 *data, int32 n) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = s;
+    sqe->addr = (unsigned long)data;
+    sqe->len = n;
+    sqe->user_data = UdSend;
+}
+
+/* a pure timeout, completing with -ETIME after 'ts' */
+static void prep_tick(Uring *r, struct __kernel_timespec *ts) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = UdTick;
+}
+
+/* cancel the pending timeout, which then completes with -ECANCELED */
+static void prep_untick(Uring *r) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = UdTick;
+    sqe->user_data = UdUntick;
+}
+
+/* wait for 'fd' to become readable, once */
+static void prep_pollin(Uring *r, int fd) {
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_sqe(r);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UdWatch;
+}
+
+/*
+ * Accept loop of the parent process, one multishot accept per listening socket.
+ * One submission keeps producing a completion (the new socket) per connection.
+ * Returns -1 right away if the kernel cannot do it; otherwise runs until
+ * scontinuation drops and returns 0.
+ */
+int uring_mainloop(void) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct sockaddr_storage cli;
+    socklen_t len;
+    bool armed[MaxListeners];
+    bool served;
+    int16 n;
+    int res;
+
+    if (ring_init(&parent, 8) < 0)
+        return -1;
+
+    for (n = 0; n < nlisteners; n++)
+        armed[n] = false;
+    for (served = false; scontinuation;) {
+        for (n = 0; n < nlisteners; n++) {
+            if (armed[n])
+                continue;
+            sqe = ring_sqe(&parent);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listeners[n];
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = UdAccept | (n << 8);
+            armed[n] = true;
+        }
+        if (ring_enter(&parent, 1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("io_uring_enter");
+            break;
+        }
+
+        // spawn() runs before the cqe is consumed, so uring_detach() in the
+        // child can tell this socket from the ones still queued behind it.
+        while ((cqe = ring_cqe(&parent))) {
+            res = cqe->res;
+            n = (int16)UdListener(cqe->user_data);
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                armed[n] = false;
+
+            if (res == -EINVAL && !served) {
+                // Multishot accept needs Linux 5.19; use the plain loop instead.
+                ring_seen(&parent);
+                ring_exit(&parent);
+                return -1;
+            } else if (res < 0) {
+                if (res != -EINTR) {
+                    errno = -res;
+                    perror("accept");
+                }
+            } else {
+                len = sizeof(cli);
+                if (getpeername(res, (struct sockaddr *)&cli, &len) < 0)
+                    zero((int8 *)&cli, sizeof(cli));
+                spawn(res, (struct sockaddr *)&cli);
+                served = true;
+            }
+            ring_seen(&parent);
+        }
+    }
+
+    ring_exit(&parent);
+    return 0;
+}
+
+/*
+ * Drop the parent's accept ring in a freshly forked child, along with the
+ * sockets it accepted for other clients that the parent has not spawned yet.
+ */
+void uring_detach(void) {
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    if (parent.fd < 0)
+        return;
+
+    // The cqe at the head is this child's own connection; skip it.
+    tail = __atomic_load_n(parent.cqtail, __ATOMIC_ACQUIRE);
+    head = *parent.cqhead;
+    for (head += (head != tail); head != tail; head++) {
+        cqe = &parent.cqes[head & *parent.cqmask];
+        if (UdTag(cqe->user_data) == UdAccept && cqe->res >= 0)
+            close(cqe->res);
+    }
+    ring_exit(&parent);
+}
+
+/*
+ * Client loop of a child process on io_uring.
+ * A multishot recv keeps filling provided buffers without being re-armed, and
+ * the replies to every line received so far go out in one send that is submitted
+ * together with the wait for more input, so a request costs a single syscall.
+ * While the client watches subtrees, a poll on watch_fd() wakes the loop to
+ * push the changes made by other connections (without one, a timeout every
+ * WatchTick milliseconds does). A timeout also wakes it when the connection
+ * would become idle, to close it.
+ * Returns -1 if io_uring is unavailable (nothing has been done yet), 0 once the
+ * connection is over.
+ */
+int uring_childloop(Client *cli) {
+    Uring r;
+    struct __kernel_timespec tick; /* set by each prep_tick() */
+    int16 qbid[UringBufs];   /* received buffers waiting for receive() */
+    int32 qlen[UringBufs];
+    unsigned qhead, qtail;
+    int32 sent;
+    bool armed, multishot, sending, ticking, untick, doorbell, eof, failed;
+    struct io_uring_cqe *cqe;
+    int8 *buf;
+    int16 bid;
+    int res, wait, tickms = 0;
+
+    if (ring_init(&r, UringEntries) < 0)
+        return -1;
+    if (bufring_init(&r) < 0) {
+        ring_exit(&r);
+        return -1;
+    }
+
+    qhead = qtail = 0;
+    sent = 0;
+    armed = sending = ticking = untick = doorbell = eof = failed = false;
+    multishot = true;
+    ccontinuation = true;
+
+    while (!failed) {
+        // Run the received lines, but never while a send still reads cli->out.
+        // Lines received after an SHM are still served, with their replies on the socket.
+        while (!sending && ccontinuation && qhead != qtail) {
+            bid = qbid[qhead % UringBufs];
+            buf = r.bufs + bid * UringBufSize;
+            receive(cli, buf, qlen[qhead % UringBufs]);
+            bufring_put(&r, bid);
+            qhead++;
+        }
+
+        // After a successful SHM the rest of the session runs over shared memory.
+        if (cli->shm && !sending) {
+            cflush(cli);
+            ring_exit(&r);
+            shmloop(cli);
+            return 0;
+        }
+
+        if (!sending)
+            watch_push(cli);
+        if (!sending && cli->outlen) {
+            prep_send(&r, cli->s, cli->out, cli->outlen);
+            sending = true;
+            sent = 0;
+        }
+        if (!sending && (eof || !ccontinuation))
+            break;
+
+        // Re-arm the recv only while at least one buffer is free to receive into.
+        if (!armed && !eof && ccontinuation && qtail - qhead < UringBufs) {
+            prep_recv(&r, cli->s, multishot);
+            armed = true;
+        }
+        if (!ticking && !eof && ccontinuation && (wait = wait_ms(cli)) >= 0) {
+            tick.tv_sec = wait / 1000;
+            tick.tv_nsec = (wait % 1000) * 1000000LL;
+            prep_tick(&r, &tick);
+            ticking = true;
+            tickms = wait;
+        }
+        if (!doorbell && !eof && ccontinuation && cli->watch && watch_fd() >= 0) {
+            prep_pollin(&r, watch_fd());
+            doorbell = true;
+        }
+        // A WATCH just started under the long idle timeout: swap it for a short tick.
+        if (ticking && !untick && cli->watch && watch_fd() < 0 && tickms > WatchTick) {
+            prep_untick(&r);
+            untick = true;
+        }
+
+        if (r.pending || !ring_cqe(&r)) {
+            if (ring_enter(&r, ring_cqe(&r) ? 0 : 1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("io_uring_enter");
+                break;
+            }
+        }
+
+        while ((cqe = ring_cqe(&r))) {
+            res = cqe->res;
+            if (cqe->user_data == UdRecv) {
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    armed = false;
+                if (res > 0) {
+                    qbid[qtail % UringBufs] = (int16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    qlen[qtail % UringBufs] = res;
+                    qtail++;
+                } else if (!res) {
+                    printf("Server: Client %s:%d disconnected gracefully.\n", cli->ip, cli->port);
+                    eof = true;
+                } else if (res == -EINVAL && multishot) {
+                    multishot = false; // Pre-6.0 kernel: fall back to one recv at a time.
+                } else if (res != -ENOBUFS && res != -EINTR) {
+                    errno = -res;
+                    perror("Error reading from client socket");
+                    printf("Server: Error reading from client %s:%d. Terminating connection.\n", cli->ip, cli->port);
+                    failed = true;
+                }
+            } else if (cqe->user_data == UdWatch) {
+                doorbell = false; // New events: watch_push() runs on the next pass.
+                watch_drain();
+            } else if (cqe->user_data == UdUntick) {
+                untick = false;
+            } else if (cqe->user_data == UdTick) {
+                ticking = false;
+                if (!idle_ms(cli)) {
+                    if (sending)
+                        failed = true; // The client stopped draining its replies.
+                    else
+                        reap_idle(cli);
+                }
+            } else if (cqe->user_data == UdSend) {
+                if (res < 0) {
+                    errno = -res;
+                    perror("Error writing to client socket");
+                    failed = true;
+                } else {
+                    cli->last = monotime(); // Progress: a slow reader is not an idle one.
+                    if ((sent += res) < cli->outlen) {
+                        prep_send(&r, cli->s, cli->out + sent, cli->outlen - sent);
+                    } else {
+                        cli->outlen = 0;
+                        sending = false;
+                    }
+                }
+            }
+            ring_seen(&r);
+        }
+    }
+
+    ring_exit(&r);
+    return 0;
+}
+
+#else
+
+int uring_mainloop(void) {
+    return -1;
+}
+
+int uring_childloop(Client *cli) {
+    return -1;
+}
+
+void uring_detach(void) {
+    return;
+}
+
+#endif
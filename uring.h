@@ -0,0 +1,20 @@
+#ifndef URING
+#define URING
+#include "cache22.h"
+
+/*
+ * Optional io_uring I/O backend.
+ * Built on Linux unless compiled with -DNO_URING (make URING=0).
+ * Every entry point returns -1 when io_uring is unavailable at runtime,
+ * so callers fall back to the plain accept()/read()/write() loops.
+ */
+#define UringEntries 64   /* submission queue size of a client's ring */
+#define UringBufs    16   /* provided recv buffers per client, power of 2 */
+#define UringBufSize 256  /* bytes per recv, as in childloop(); receive() splits the lines */
+#define UringBgid    0    /* buffer group id of the provided buffer ring */
+
+int uring_mainloop(void);
+int uring_childloop(Client*);
+void uring_detach(void);
+
+#endif
@@ -0,0 +1,330 @@
+#include "watch.h"
+#include "tree.h"
+#include <sys/mman.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define SlotMask (WatchSlots - 1)
+
+static WatchRing *ring;       /* shared by the parent and every child */
+static Event batch[WatchBatch];
+static int32 mypid;
+static int efd = -1;          /* this process' doorbell, readable once events came in */
+static int32 listening;       /* this process watches: the waiter rings 'efd' */
+static int32 *extra;          /* futex to wake as well (the SHM request ring), or 0 */
+
+/* map the event ring; called once by the parent, before any fork */
+int watch_init(void) {
+    WatchRing *r;
+
+    r = (WatchRing *)mmap(0, sizeof(WatchRing), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED)
+        return -1;
+    ring = r;
+    return 0;
+}
+
+/* whether anyone listens; writers check this before building an event */
+bool watch_active(void) {
+    return ring && __atomic_load_n(&ring->watchers, __ATOMIC_RELAXED);
+}
+
+/*
+ * Record a change. Never waits: the slot is taken with one atomic add, and
+ * readers that are a whole ring behind simply lose the oldest events.
+ */
+void watch_publish(int8 op, int8 *path, int8 *key, int8 *value, int16 size) {
+    Event *e;
+    int32 seq;
+
+    if (!watch_active())
+        return;
+    seq = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+    e = &ring->ev[seq & SlotMask];
+
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->pid = (int32)getpid();
+    e->op = op;
+    snprintf((char *)e->path, sizeof(e->path), "%s", (char *)path);
+    snprintf((char *)e->key, sizeof(e->key), "%s", key ? (char *)key : "");
+    if (size > WatchValue) {
+        e->vlen = WatchValue + 1;
+    } else {
+        e->vlen = size;
+        if (size)
+            memcpy(e->value, value, size); // DEL and DROP carry no value at all.
+    }
+    __atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+
+    // Pairs with the waiter: either it sees the new 'done' or we see it sleeping.
+    __atomic_fetch_add(&ring->done, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    if (__atomic_load_n(&ring->sleepers, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->done, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#endif
+}
+
+#ifdef __linux__
+/*
+ * Thread of a watching process: sleeps until events are completed and rings
+ * 'efd' (and 'extra'). Only a count of completions is looked at, the events
+ * themselves are read by watch_push() in the client loop.
+ */
+static void *waiter(void *arg) {
+    uint64_t one = 1;
+    int32 seen, now;
+    int32 *also;
+
+    for (seen = (int32)(uintptr_t)arg;;) {
+        __atomic_fetch_add(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->done, __ATOMIC_SEQ_CST) == seen)
+            syscall(SYS_futex, &ring->done, FUTEX_WAIT, seen, 0, 0, 0);
+        __atomic_fetch_sub(&ring->sleepers, 1, __ATOMIC_RELAXED);
+
+        now = __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE);
+        if (now == seen || !__atomic_load_n(&listening, __ATOMIC_RELAXED)) {
+            seen = now;
+            continue;
+        }
+        seen = now;
+        if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return 0;
+        if ((also = __atomic_load_n(&extra, __ATOMIC_ACQUIRE)))
+            syscall(SYS_futex, also, FUTEX_WAKE, 1, 0, 0, 0);
+    }
+    return 0;
+}
+
+/* start the waiter the first time this process watches; -1 leaves it polling */
+static int waiter_start(void) {
+    pthread_attr_t attr;
+    pthread_t t;
+    sigset_t all, old;
+    int err;
+
+    if (efd >= 0)
+        return 0;
+    if ((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+
+    // Signals stay with the client loop; the thread needs little stack.
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 65536);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&t, &attr, waiter,
+        (void *)(uintptr_t)__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE));
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    if (err) {
+        close(efd);
+        efd = -1;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* readable once events may be waiting for watch_push(); -1 if the loop has to poll */
+int watch_fd(void) {
+    return efd;
+}
+
+/* reset watch_fd() before a watch_push() */
+void watch_drain(void) {
+    uint64_t n;
+
+    if (efd >= 0 && read(efd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        perror("watch_drain");
+}
+
+/* also wake the futex at 'addr' on new events (0: stop), for loops sleeping on one */
+void watch_wakes(int32 *addr) {
+    __atomic_store_n(&extra, addr, __ATOMIC_RELEASE);
+}
+
+/* 'path' is 'under' or below it */
+static bool below(int8 *path, int8 *under) {
+    size_t n;
+
+    if (!under[1])
+        return true;
+    n = strlen((char *)under);
+    return !strncmp((char *)path, (char *)under, n) && (!path[n] || path[n] == '/');
+}
+
+static bool watched(Watcher *w, Event *e) {
+    int16 i;
+
+    for (i = 0; i < w->n; i++)
+        if (below(e->path, w->paths[i]) || (e->op == EvDrop && below(w->paths[i], e->path)))
+            return true;
+    return false;
+}
+
+/* watch 'path' (absolute) and everything below it */
+int watch_add(Client *cli, int8 *path) {
+    Watcher *w;
+    size_t n;
+    int16 i;
+
+    if (!ring)
+        return -1;
+    if (!(w = cli->watch)) {
+        w = (Watcher *)malloc(sizeof(Watcher));
+        if (!w)
+            return -1;
+        w->n = 0;
+        w->seq = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+        cli->watch = w;
+        mypid = (int32)getpid();
+        __atomic_fetch_add(&ring->watchers, 1, __ATOMIC_RELAXED);
+#ifdef __linux__
+        if (waiter_start() < 0)
+            perror("watch waiter (polling instead)");
+#endif
+        __atomic_store_n(&listening, 1, __ATOMIC_RELAXED);
+    }
+
+    n = strlen((char *)path);
+    while (n > 1 && path[n - 1] == '/')
+        path[--n] = '\0';
+    for (i = 0; i < w->n; i++)
+        if (!strcmp((char *)w->paths[i], (char *)path))
+            return 0;
+    if (w->n == WatchMax) {
+        errno = ENOSPC;
+        return -1;
+    }
+    snprintf((char *)w->paths[w->n++], sizeof(w->paths[0]), "%s", (char *)path);
+    return 0;
+}
+
+bool watch_remove(Client *cli, int8 *path) {
+    Watcher *w;
+    size_t n;
+    int16 i;
+
+    if (!(w = cli->watch))
+        return false;
+    n = strlen((char *)path);
+    while (n > 1 && path[n - 1] == '/')
+        path[--n] = '\0';
+    for (i = 0; i < w->n; i++)
+        if (!strcmp((char *)w->paths[i], (char *)path))
+            break;
+    if (i == w->n)
+        return false;
+    memmove(w->paths[i], w->paths[i + 1], (w->n - i - 1) * sizeof(w->paths[0]));
+    if (!--w->n)
+        watch_detach(cli);
+    return true;
+}
+
+/* queue the batch on 'cli', oldest change first */
+static void emit(Client *cli, int16 n) {
+    Event *e;
+    int16 i;
+
+    for (i = 0, e = batch; i < n; i++, e++) {
+        if (e->op == EvDrop) {
+            cprintf(cli, "EVENT DROP %s\n", (char *)e->path);
+        } else if (e->op == EvDel) {
+            cprintf(cli, "EVENT DEL %s %s\n", (char *)e->path, (char *)e->key);
+        } else if (e->vlen > WatchValue) {
+            cprintf(cli, "EVENT PUT %s %s\n", (char *)e->path, (char *)e->key);
+        } else {
+            cprintf(cli, "EVENT PUT %s %s=", (char *)e->path, (char *)e->key);
+            cwrite(cli, e->value, e->vlen);
+            cwrite(cli, (int8 *)"\n", 1);
+        }
+    }
+}
+
+/*
+ * Queue on 'cli' the events published since the last call that fall under
+ * its watches. A change to a key already in the batch replaces the earlier
+ * one (and moves to the end, to keep the order of the last states).
+ * Returns the number of lines queued; 0 right away when nothing is new.
+ */
+int32 watch_push(Client *cli) {
+    Watcher *w;
+    Event *e, *b;
+    int32 next, seq, lost, lines;
+    int16 n, i;
+
+    w = cli->watch;
+    if (!w)
+        return 0;
+    next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    if (w->seq == next)
+        return 0;
+
+    lost = lines = 0;
+    if (next - w->seq > WatchSlots) {
+        lost = next - WatchSlots - w->seq;
+        w->seq = next - WatchSlots;
+    }
+
+    for (n = 0; w->seq != next; w->seq++) {
+        e = &ring->ev[w->seq & SlotMask];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        if (seq != w->seq + 1) {
+            if (!seq || (int)(seq - (w->seq + 1)) < 0)
+                break; // Still being written: pick it up next time.
+            lost++;    // Overwritten by a writer a whole ring ahead.
+            continue;
+        }
+
+        b = &batch[n];
+        memcpy(b, e, sizeof(Event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+            lost++;
+            continue;
+        }
+        if (b->pid == mypid || !watched(w, b))
+            continue;
+
+        for (i = 0; i < n; i++)
+            if (!strcmp((char *)batch[i].path, (char *)b->path) && !strcmp((char *)batch[i].key, (char *)b->key))
+                break;
+        if (i < n) {
+            memmove(&batch[i], &batch[i + 1], (n - i) * sizeof(Event));
+            n--;
+        }
+        if (++n == WatchBatch) {
+            emit(cli, n);
+            lines += n;
+            n = 0;
+        }
+    }
+
+    if (lost) {
+        cprintf(cli, "EVENT LOST %u\n", lost);
+        lines++;
+    }
+    emit(cli, n);
+    if (lines + n)
+        cli->last = monotime(); // Progress: keeps a busy watcher from counting as idle.
+    return lines + n;
+}
+
+/* stop watching; the connection no longer counts as a watcher */
+void watch_detach(Client *cli) {
+    if (!cli->watch)
+        return;
+    free(cli->watch);
+    cli->watch = (Watcher *)0;
+    __atomic_store_n(&listening, 0, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&ring->watchers, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,80 @@
+#ifndef WATCH
+#define WATCH
+#include "cache22.h"
+
+/*
+ * Change notifications for WATCH.
+ * Every connection runs in its own process with its own copy of the tree, so
+ * an event tells what another session did to its tree; nothing is applied to
+ * the watcher's. Events travel through one event ring in shared memory,
+ * mapped by the parent before it forks. Writers
+ * (PUT, APPEND, INCR..., DEL) claim a slot and fill it without ever waiting
+ * for readers; once the ring wraps, the oldest events are overwritten.
+ * Each watching connection keeps its own read position and, whenever events
+ * were published, turns the new ones under its subtrees into one batch:
+ *   EVENT PUT <path> <key>=<value>   (just <key> if the value did not fit)
+ *   EVENT DEL <path> <key>
+ *   EVENT DROP <path>                (the folder and everything below it)
+ *   EVENT LOST <n>                   (this connection fell behind by n events)
+ * Several changes to one key within a batch are sent once, with the last state.
+ *
+ * Each slot is a small seqlock: 'seq' is 0 while a writer fills it and the
+ * event's sequence number + 1 once complete. A reader copies the slot and
+ * only keeps the copy if 'seq' held the number it expected before and after.
+ *
+ * Nobody polls for events. A writer bumps 'done' once its slot is complete and,
+ * if anyone sleeps on it, wakes them all with FUTEX_WAKE. In a watching process
+ * one small thread sleeps there and makes watch_fd() readable for the client
+ * loop, which waits on it along with the socket. Without futexes (not Linux)
+ * the loops look every WatchTick milliseconds instead.
+ */
+#define WatchSlots 4096 /* events in the ring, power of 2 (about 3.7 MB) */
+#define WatchValue 512  /* value bytes carried by an event */
+#define WatchMax   8    /* watched subtrees per connection */
+#define WatchBatch 64   /* distinct changes coalesced into one push */
+#define WatchTick  50   /* milliseconds between checks, where watch_fd() is not available */
+
+#define EvPut  1
+#define EvDel  2
+#define EvDrop 3
+
+struct s_event {
+    int32 seq;
+    int32 pid;          /* writer, whose own connection is not told */
+    int8 op;
+    int16 vlen;         /* value bytes, or WatchValue + 1 when it was too long */
+    int8 path[256];
+    int8 key[128];
+    int8 value[WatchValue];
+};
+typedef struct s_event Event;
+
+struct s_watchring {
+    int32 next;         /* sequence number of the next event, claimed by writers */
+    int32 watchers;     /* connections watching; writers skip everything at 0 */
+    int32 done;         /* bumped after each completed event: the futex waiters sleep on */
+    int32 sleepers;     /* threads sleeping on 'done', so writers know to wake them */
+    int8 pad[48];
+    Event ev[WatchSlots];
+};
+typedef struct s_watchring WatchRing;
+
+struct s_watcher {
+    int32 seq;          /* next event to look at */
+    int16 n;
+    int8 paths[WatchMax][256];
+};
+typedef struct s_watcher Watcher;
+
+int watch_init(void);
+bool watch_active(void);
+void watch_publish(int8,int8*,int8*,int8*,int16);
+int watch_add(Client*,int8*);
+bool watch_remove(Client*,int8*);
+int32 watch_push(Client*);
+void watch_detach(Client*);
+int watch_fd(void);
+void watch_drain(void);
+void watch_wakes(int32*);
+
+#endif